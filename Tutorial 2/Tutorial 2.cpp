@@ -1,7 +1,20 @@
+#include <cerrno>
 #include <iostream>
+#include <thread>
 #include <vector>
 
 #include "Utils.h"
+#include "ProgramLibrary.h"
+#include "BatchIO.h"
+#include "BufferPool.h"
+#include "DeviceMemoryTracker.h"
+#include "DeviceArena.h"
+#include "FrameStream.h"
+#include "HostMemory.h"
+#include "ImageCache.h"
+#include "PnmIO.h"
+#include "StagingBuffer.h"
+#include "SvmBuffer.h"
 #include "CImg.h"
 #include <CL/opencl.hpp>
 
@@ -13,163 +26,1241 @@ void print_help() {
 	std::cerr << "  -p : select platform " << std::endl;
 	std::cerr << "  -d : select device" << std::endl;
 	std::cerr << "  -l : list all platforms and devices" << std::endl;
-	std::cerr << "  -f : input image file (default: test.ppm)" << std::endl;
+	std::cerr << "  -f : input image file (PGM/PPM/PAM, image cache or any format CImg reads), repeat to process a batch (default: test.ppm)" << std::endl;
+	std::cerr << "  -n : do not display the input and output images" << std::endl;
+	std::cerr << "  -o : write the equalised image to this PGM/PPM file (PAM for images with alpha), numbered per image for a batch" << std::endl;
+	std::cerr << "  -pa : pass the alpha channel of RGBA and grey + alpha images through unequalised" << std::endl;
+	std::cerr << "  -y4m : equalise the luma of a Y4M stream from stdin to stdout, logging to stderr" << std::endl;
+	std::cerr << "  -raw : width height channels, equalise raw planar frames of this size from stdin to stdout" << std::endl;
+	std::cerr << "  -vol : equalise each input as a volume with one histogram over all its slices, streamed through slabs whose buffers" << std::endl;
+	std::cerr << "         (device input and output plus host staging for each of two slabs in flight) take at most this many MB, or" << std::endl;
+	std::cerr << "         one slice each if a slice is larger; image cache inputs are read in place and -o writes an image cache," << std::endl;
+	std::cerr << "         which keeps the depth" << std::endl;
+	std::cerr << "  -wc : write each input image as an image cache file in the -layout layout, numbered per image for a batch" << std::endl;
+	std::cerr << "  -oc : number of chunks the output file is written in concurrently, up to the hardware threads (default: 1)" << std::endl;
+	std::cerr << "  -bio : read the batch ahead and write outputs behind the pipeline, through io_uring in Linux builds with USE_IO_URING" << std::endl;
+	std::cerr << "  -m : device buffer pool memory cap in MB (default: unlimited)" << std::endl;
+	std::cerr << "  -nz : disable zero-copy host buffers on unified memory devices" << std::endl;
+	std::cerr << "  -np : disable pinned staging buffers, transfer from pageable host memory" << std::endl;
+	std::cerr << "  -ns : disable the shared virtual memory pipeline (builds with ENABLE_SVM only)" << std::endl;
+	std::cerr << "  -bt : benchmark pageable against pinned transfers at the first image size" << std::endl;
+	std::cerr << "  -numa : place host image memory on this NUMA node and use the node's CPU sub-device" << std::endl;
+	std::cerr << "  -hp : back host image memory with huge pages where possible" << std::endl;
+	std::cerr << "  -bh : benchmark default against -numa/-hp host memory at the first image size" << std::endl;
+	std::cerr << "  -layout : planar (default), interleaved, which processes PPM pixels as stored," << std::endl;
+	std::cerr << "            or device, which converts between the layouts on the device around the planar kernels" << std::endl;
+	std::cerr << "  -w : warm up the pipeline kernels and pooled buffers before the first image" << std::endl;
+	std::cerr << "  -c : program binary cache directory (default: kernel_cache)" << std::endl;
+	std::cerr << "  -nc : disable the program binary cache" << std::endl;
+	std::cerr << "  -k : load kernel sources from this directory instead of the embedded copies" << std::endl;
 	std::cerr << "  -h : print this message" << std::endl;
 }
 
+//how images get between host and device memory
+enum TransferMode {
+	TRANSFER_PAGEABLE, //blocking copies from/to ordinary host memory
+	TRANSFER_PINNED, //non-blocking copies from/to pinned staging memory (see StagingBuffer)
+	TRANSFER_ZERO_COPY //device uses page-aligned host memory in place (see HostBuffer)
+};
+
+//how pixels are laid out in the host and device image memory
+enum ImageLayout {
+	LAYOUT_PLANAR, //CImg's layout, one whole channel after another
+	LAYOUT_INTERLEAVED, //packed pixels as in PPM files; the CImg objects keep their dimensions but hold RGBRGB...
+	LAYOUT_DEVICE_CONVERT //interleaved host memory, converted to planar and back on the device for the planar kernels
+};
+
+void PrintKernelProfile(const cl::Event& profile_event) {
+	std::cout << "Kernel execution time [ns]: " << profile_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - profile_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
+	std::cout << GetFullProfilingInfo(profile_event, ProfilingResolution::PROF_US) << std::endl;
+}
+
+//enqueues the intensity histogram kernel for the layout; image and histogram are cl::Buffers or SVM pointers
+//with pass_alpha the last channel is left out, so the histogram only has 256 * (spectrum - 1) bins
+template <typename ImageMemory, typename HistogramMemory>
+void EnqueueHistogram(ProgramLibrary& programs, cl::CommandQueue& queue, ImageLayout layout, const ImageMemory& image, const HistogramMemory& histogram,
+	int width, int height, int spectrum, cl::Event* event = nullptr, bool pass_alpha = false) {
+	int channels = pass_alpha ? spectrum - 1 : spectrum;
+	if (layout == LAYOUT_PLANAR) {
+		//the alpha plane comes last, so it is simply not covered by the range
+		BoundKernel& kernel = programs.Kernel("equalisation", "histogram255");
+		kernel.Bind(0, image);
+		kernel.Bind(1, histogram);
+		queue.enqueueNDRangeKernel(kernel.Kernel(), cl::NullRange, cl::NDRange(width, height, channels), cl::NullRange, NULL, event);
+	}
+	else {
+		//one work item per pixel in groups of 256, each group with its own local histogram
+		const int group_size = 256;
+		int pixel_count = width * height;
+		BoundKernel& kernel = programs.Kernel("equalisation", pass_alpha ? "histogram_alpha" : "histogram_interleaved");
+		kernel.Bind(0, image);
+		kernel.Bind(1, histogram);
+		kernel.Bind(2, pixel_count);
+		kernel.Bind(3, spectrum);
+		kernel.Bind(4, cl::Local(256 * channels * sizeof(int)));
+		size_t global_size = ((pixel_count + group_size - 1) / group_size) * group_size;
+		queue.enqueueNDRangeKernel(kernel.Kernel(), cl::NullRange, cl::NDRange(global_size), cl::NDRange(group_size), NULL, event);
+	}
+}
+
+//enqueues the back-projection kernel for the layout
+//with pass_alpha interleaved images get their alpha copied through, planar ones leave the alpha plane of image_output
+//untouched for the caller to copy
+template <typename ImageMemory, typename HistogramMemory>
+void EnqueueProjection(ProgramLibrary& programs, cl::CommandQueue& queue, ImageLayout layout, const ImageMemory& image_input, const HistogramMemory& lut,
+	const ImageMemory& image_output, int width, int height, int spectrum, cl::Event* event = nullptr, bool pass_alpha = false) {
+	const char* interleaved_kernel = pass_alpha ? "project_alpha" : "project_interleaved";
+	BoundKernel& kernel = programs.Kernel("equalisation", layout == LAYOUT_PLANAR ? "project" : interleaved_kernel);
+	kernel.Bind(0, image_input);
+	kernel.Bind(1, lut);
+	kernel.Bind(2, image_output);
+	if (layout == LAYOUT_PLANAR) {
+		queue.enqueueNDRangeKernel(kernel.Kernel(), cl::NullRange, cl::NDRange(width, height, pass_alpha ? spectrum - 1 : spectrum), cl::NullRange, NULL, event);
+	}
+	else {
+		kernel.Bind(3, spectrum);
+		queue.enqueueNDRangeKernel(kernel.Kernel(), cl::NullRange, cl::NDRange(width * height), cl::NullRange, NULL, event);
+	}
+}
+
+//enqueues the interleaved to planar ("deinterleave") or planar to interleaved ("interleave") conversion of an image
+template <typename ImageMemory>
+void EnqueueLayoutConversion(ProgramLibrary& programs, cl::CommandQueue& queue, const char* kernel_name, const ImageMemory& source,
+	const ImageMemory& destination, int pixel_count, int spectrum, cl::Event* event = nullptr) {
+	//each group of 256 work items transposes a tile of 256 pixels through local memory
+	const int group_size = 256;
+	BoundKernel& kernel = programs.Kernel("layout", kernel_name);
+	kernel.Bind(0, source);
+	kernel.Bind(1, destination);
+	kernel.Bind(2, pixel_count);
+	kernel.Bind(3, spectrum);
+	kernel.Bind(4, cl::Local(group_size * spectrum));
+	size_t global_size = ((pixel_count + group_size - 1) / group_size) * group_size;
+	queue.enqueueNDRangeKernel(kernel.Kernel(), cl::NullRange, cl::NDRange(global_size), cl::NDRange(group_size), NULL, event);
+}
+
+//planar copy of an image for display
+CImg<unsigned char> PlanarImage(const CImg<unsigned char>& image, ImageLayout layout) {
+	if (layout == LAYOUT_PLANAR)
+		return CImg<unsigned char>(image, true);
+	//viewed as (channel, x, y) the interleaved bytes are a volume whose axes only need reordering
+	return CImg<unsigned char>(image.data(), image.spectrum(), image.width(), image.height(), 1, true).get_permute_axes("yzcx");
+}
+
+//runs the histogram equalisation pipeline on one image, writing the equalised image into image_output
+//in zero-copy mode both images must live in page-aligned host memory (see HostBuffer), which the device uses in place,
+//in pinned mode they should be views of staging memory so that the transfers do not block
+//host-side intermediates come from host_arena, which the caller rewinds between images
+//device allocations are made through tracker (directly or via the pool), which reports the footprint per stage
+//a precomputed intensity histogram (e.g. from an image cache) replaces step 1
+//with pass_alpha the last channel is copied to the output unequalised
+//write_output is handed the result interleaved, as image files store it: planar colour results are interleaved on the
+//device into a pooled buffer that is mapped for the call, so the host does not copy them again before writing
+void EqualiseImage(const CImg<unsigned char>& image_input, CImg<unsigned char>& image_output, ProgramLibrary& programs,
+	cl::CommandQueue& queue, BufferPool& pool, HostArena& host_arena, DeviceMemoryTracker& tracker, TransferMode transfer_mode, ImageLayout layout,
+	bool pass_alpha = false, const int* intensity_histogram = nullptr, const function<void(const unsigned char*)>& write_output = nullptr) {
+	//device - buffers
+	tracker.SetStage("upload");
+	PooledBuffer pooled_input, pooled_output;
+	cl::Buffer dev_image_input, dev_image_output;
+	cl::Event upload_event, download_event;
+	if (transfer_mode == TRANSFER_ZERO_COPY) {
+		//wrap the host images, on unified memory devices no transfer takes place
+		cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+		dev_image_input = tracker.CreateBuffer(context, CL_MEM_READ_ONLY | CL_MEM_USE_HOST_PTR, image_input.size(), (void*)image_input.data());
+		dev_image_output = tracker.CreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_USE_HOST_PTR, image_output.size(), image_output.data());
+	}
+	else {
+		//checked out of the pool and returned to it at scope exit
+		pooled_input = pool.Acquire(image_input.size(), CL_MEM_READ_ONLY);
+		pooled_output = pool.Acquire(image_input.size(), CL_MEM_READ_WRITE); //should be the same as input image
+		dev_image_input = pooled_input.Get();
+		dev_image_output = pooled_output.Get();
+
+		//4.1 Copy images to device memory
+		//from pinned memory the upload runs asynchronously, the in-order queue keeps the kernels behind it
+		cl_bool blocking = transfer_mode == TRANSFER_PAGEABLE ? CL_TRUE : CL_FALSE;
+		queue.enqueueWriteBuffer(dev_image_input, blocking, 0, image_input.size(), &image_input.data()[0], NULL, &upload_event);
+	}
+
+	//the kernels read and write the image buffers directly, unless the layout is converted on the device first
+	cl::Event profile_event;
+	int pixel_count = image_input.width() * image_input.height();
+	ImageLayout kernel_layout = layout;
+	cl::Buffer dev_kernel_input = dev_image_input, dev_kernel_output = dev_image_output;
+	PooledBuffer pooled_planar_input, pooled_planar_output;
+	if (layout == LAYOUT_DEVICE_CONVERT) {
+		tracker.SetStage("deinterleave");
+		pooled_planar_input = pool.Acquire(image_input.size(), CL_MEM_READ_WRITE);
+		pooled_planar_output = pool.Acquire(image_input.size(), CL_MEM_READ_WRITE);
+		dev_kernel_input = pooled_planar_input.Get();
+		dev_kernel_output = pooled_planar_output.Get();
+		kernel_layout = LAYOUT_PLANAR;
+		EnqueueLayoutConversion(programs, queue, "deinterleave", dev_image_input, dev_kernel_input, pixel_count, image_input.spectrum(), &profile_event);
+		std::cout << "Deinterleave complete" << std::endl;
+		clFinish(queue.get());
+		PrintKernelProfile(profile_event);
+	}
+
+	//  STEP 1 :: Generate Intensity Histogram
+	tracker.SetStage("intensity histogram");
+	//		buffers
+	int channels = pass_alpha ? image_input.spectrum() - 1 : image_input.spectrum();
+	size_t histogram_size = 256 * channels;
+	int* cumulative_histogram = host_arena.Allocate<int>(histogram_size);
+	//		all intermediates are sub-buffers of one arena allocation
+	DeviceArena arena(pool, queue.getInfo<CL_QUEUE_DEVICE>());
+	int dev_intensity_histogram = arena.Reserve("intensity histogram", histogram_size * sizeof(int));
+	int dev_cumulative_histogram = arena.Reserve("cumulative histogram", histogram_size * sizeof(int));
+	int dev_normalised_histogram = arena.Reserve("normalised histogram", histogram_size * sizeof(int));
+	int dev_divideby = arena.Reserve("divide by", sizeof(int));
+	arena.Commit();
+	if (intensity_histogram) {
+		queue.enqueueWriteBuffer(arena.Get(dev_intensity_histogram), CL_TRUE, 0, histogram_size * sizeof(int), intensity_histogram);
+		std::cout << "Intensity histogram precomputed" << std::endl;
+	}
+	else {
+		//		recycled buffers hold the previous image's counts, so the histogram is cleared first
+		queue.enqueueFillBuffer(arena.Get(dev_intensity_histogram), 0, 0, histogram_size * sizeof(int));
+
+		//		kernel (the first kernel request waits for the background build, later images reuse the cached kernels)
+		EnqueueHistogram(programs, queue, kernel_layout, dev_kernel_input, arena.Get(dev_intensity_histogram), image_input.width(), image_input.height(), image_input.spectrum(),
+			&profile_event, pass_alpha);
+		//		read
+		std::cout << "Intensity histogram complete" << std::endl;
+		clFinish(queue.get());
+		PrintKernelProfile(profile_event);
+	}
+
+	//  STEP 2 :: Calculate cumulative histogram
+	tracker.SetStage("cumulative histogram");
+	BoundKernel& cumulativeHistKernel = programs.Kernel("equalisation", "scan_add");
+	cumulativeHistKernel.Bind(0, arena.Get(dev_intensity_histogram));
+	cumulativeHistKernel.Bind(1, arena.Get(dev_cumulative_histogram));
+	cumulativeHistKernel.Bind(2, cl::Local(histogram_size * sizeof(int)));
+	cumulativeHistKernel.Bind(3, cl::Local(histogram_size * sizeof(int)));
+	//		run kernel once for each colour channel (eg: once for greyscale or 3 times for rgb).
+	//		works out offset and size (only works for 256 colour values)
+	for (int i = 0; i < channels; i++)
+	{
+		queue.enqueueNDRangeKernel(cumulativeHistKernel.Kernel(), cl::NDRange(256 * i), cl::NDRange(256), cl::NullRange, NULL, &profile_event);
+		std::cout << "Cumulative Histogram " << i << std::endl;
+		clFinish(queue.get());
+		PrintKernelProfile(profile_event);
+	}
+
+	std::cout << "Cumulative Histogram Complete" << std::endl;
+	//  STEP 3 :: Normalise histogram
+	tracker.SetStage("normalise");
+	//		find max
+	queue.enqueueReadBuffer(arena.Get(dev_cumulative_histogram), CL_TRUE, 0, histogram_size * sizeof(int), cumulative_histogram);
+	int max = cumulative_histogram[histogram_size - 1];
+	for (int i = 0; i < channels; i++)
+	{
+		int v = cumulative_histogram[(256 * (i + 1)) - 1];
+		if (v > max)
+			max = v;
+	}
+	//		devices
+	queue.enqueueWriteBuffer(arena.Get(dev_divideby), CL_TRUE, 0, sizeof(int), &max);
+	//		kernel
+	BoundKernel& normalise = programs.Kernel("equalisation", "divide");
+	normalise.Bind(0, arena.Get(dev_cumulative_histogram));
+	normalise.Bind(1, arena.Get(dev_normalised_histogram));
+	normalise.Bind(2, arena.Get(dev_divideby));
+	queue.enqueueNDRangeKernel(normalise.Kernel(), cl::NullRange, cl::NDRange(histogram_size), cl::NullRange, NULL, &profile_event);
+	std::cout << "Normalised Histogram" << std::endl;
+	clFinish(queue.get());
+	PrintKernelProfile(profile_event);
+
+	//  STEP 4 :: Back-projection using lut
+	tracker.SetStage("back-projection");
+	EnqueueProjection(programs, queue, kernel_layout, dev_kernel_input, arena.Get(dev_normalised_histogram), dev_kernel_output,
+		image_input.width(), image_input.height(), image_input.spectrum(), &profile_event, pass_alpha);
+	if (pass_alpha && kernel_layout == LAYOUT_PLANAR) {
+		size_t alpha_offset = (size_t)channels * pixel_count;
+		queue.enqueueCopyBuffer(dev_kernel_input, dev_kernel_output, alpha_offset, alpha_offset, pixel_count);
+	}
+	std::cout << "Back-projection Complete" << std::endl;
+	clFinish(queue.get());
+	PrintKernelProfile(profile_event);
+
+	if (layout == LAYOUT_DEVICE_CONVERT) {
+		tracker.SetStage("interleave");
+		EnqueueLayoutConversion(programs, queue, "interleave", dev_kernel_output, dev_image_output, pixel_count, image_input.spectrum(), &profile_event);
+		std::cout << "Interleave complete" << std::endl;
+		clFinish(queue.get());
+		PrintKernelProfile(profile_event);
+	}
+
+	std::cout << arena.Report();
+
+	//4.3 Copy the result from device to host
+	tracker.SetStage("download");
+	if (transfer_mode == TRANSFER_ZERO_COPY) {
+		//mapping synchronises the host memory the device wrote to; it only has to be copied if the runtime did not use it in place
+		unsigned char* mapped = (unsigned char*)queue.enqueueMapBuffer(dev_image_output, CL_TRUE, CL_MAP_READ, 0, image_output.size());
+		if (mapped != image_output.data())
+			memcpy(image_output.data(), mapped, image_output.size());
+		queue.enqueueUnmapMemObject(dev_image_output, mapped);
+		queue.finish();
+	}
+	else {
+		cl_bool blocking = transfer_mode == TRANSFER_PAGEABLE ? CL_TRUE : CL_FALSE;
+		queue.enqueueReadBuffer(dev_image_output, blocking, 0, image_output.size(), image_output.data(), NULL, &download_event);
+		queue.finish();
+
+		double upload_ms = (upload_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - upload_event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / 1e6;
+		double download_ms = (download_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - download_event.getProfilingInfo<CL_PROFILING_COMMAND_START>()) / 1e6;
+		std::cout << (transfer_mode == TRANSFER_PINNED ? "Pinned" : "Pageable") << " upload [MB/s]: " << TransferRate(image_input.size(), upload_ms)
+			<< ", download [MB/s]: " << TransferRate(image_output.size(), download_ms) << std::endl;
+	}
+
+	if (write_output && layout == LAYOUT_PLANAR && image_output.spectrum() > 1) {
+		tracker.SetStage("output");
+		PooledBuffer pooled_interleaved = pool.Acquire(image_output.size(), CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR);
+		EnqueueLayoutConversion(programs, queue, "interleave", dev_image_output, pooled_interleaved.Get(), pixel_count, image_output.spectrum());
+		void* mapped = queue.enqueueMapBuffer(pooled_interleaved.Get(), CL_TRUE, CL_MAP_READ, 0, image_output.size());
+		write_output((const unsigned char*)mapped);
+		queue.enqueueUnmapMemObject(pooled_interleaved.Get(), mapped);
+		queue.finish();
+	}
+	else if (write_output) {
+		write_output(image_output.data());
+	}
+
+	std::cout << tracker.Report();
+}
+
+//runs every kernel of the equalisation pipeline twice on a tiny dummy image, so that the first real image does not pay
+//for lazy code finalisation and first-touch page faults; returns the first (cold) and second (warm) launch time per kernel.
+//image_size > 0 also faults in pooled image buffers of that size, which the first image then gets from the pool.
+//the kernel variants are those the run will use: with pass_alpha the alpha kernels (on an RGBA dummy), with
+//interleave_output the interleave kernel that planar results are written out through.
+//can be called at any point after the context is set up, e.g. at service start.
+string WarmUpPipeline(ProgramLibrary& programs, cl::CommandQueue& queue, BufferPool& pool, DeviceMemoryTracker& tracker, size_t image_size,
+	ImageLayout layout = LAYOUT_PLANAR, bool pass_alpha = false, bool interleave_output = false) {
+	const int width = 16, height = 16, spectrum = pass_alpha ? 4 : 3;
+	const int channels = pass_alpha ? spectrum - 1 : spectrum;
+	const size_t pixels = width * height * spectrum, histogram_size = 256 * channels;
+	tracker.SetStage("warm-up");
+
+	if (image_size) {
+		PooledBuffer image_input = pool.Acquire(image_size, CL_MEM_READ_ONLY);
+		PooledBuffer image_output = pool.Acquire(image_size, CL_MEM_READ_WRITE);
+		queue.enqueueFillBuffer(image_input.Get(), (cl_uchar)0, 0, image_input.Capacity());
+		queue.enqueueFillBuffer(image_output.Get(), (cl_uchar)0, 0, image_output.Capacity());
+		queue.finish();
+	}
+
+	std::vector<unsigned char> dummy(pixels);
+	for (size_t i = 0; i < pixels; i++)
+		dummy[i] = (unsigned char)(i * 37);
+	int max = width * height;
+
+	PooledBuffer dev_image_input = pool.Acquire(pixels, CL_MEM_READ_ONLY);
+	PooledBuffer dev_image_output = pool.Acquire(pixels, CL_MEM_READ_WRITE);
+	PooledBuffer dev_intensity_histogram = pool.Acquire(histogram_size * sizeof(int));
+	PooledBuffer dev_cumulative_histogram = pool.Acquire(histogram_size * sizeof(int));
+	PooledBuffer dev_normalised_histogram = pool.Acquire(histogram_size * sizeof(int));
+	PooledBuffer dev_divideby = pool.Acquire(sizeof(int));
+	queue.enqueueWriteBuffer(dev_image_input.Get(), CL_TRUE, 0, pixels, dummy.data());
+	queue.enqueueWriteBuffer(dev_divideby.Get(), CL_TRUE, 0, sizeof(int), &max);
+
+	BoundKernel& cumulativeHistKernel = programs.Kernel("equalisation", "scan_add");
+	cumulativeHistKernel.Bind(0, dev_intensity_histogram.Get());
+	cumulativeHistKernel.Bind(1, dev_cumulative_histogram.Get());
+	cumulativeHistKernel.Bind(2, cl::Local(histogram_size * sizeof(int)));
+	cumulativeHistKernel.Bind(3, cl::Local(histogram_size * sizeof(int)));
+	BoundKernel& normalise = programs.Kernel("equalisation", "divide");
+	normalise.Bind(0, dev_cumulative_histogram.Get());
+	normalise.Bind(1, dev_normalised_histogram.Get());
+	normalise.Bind(2, dev_divideby.Get());
+
+	//host-timed from enqueue to completion, since finalisation happens inside the first enqueue
+	//with device conversion the planar kernels run in between deinterleave and interleave, which are timed last
+	ImageLayout kernel_layout = layout == LAYOUT_INTERLEAVED ? LAYOUT_INTERLEAVED : LAYOUT_PLANAR;
+	const char* names[6] = { "histogram255", "scan_add", "divide", "project", "deinterleave", "interleave" };
+	bool deinterleave = layout == LAYOUT_DEVICE_CONVERT;
+	bool interleave = deinterleave || (layout == LAYOUT_PLANAR && interleave_output);
+	bool launched[6] = { true, true, true, true, deinterleave, interleave };
+	if (layout == LAYOUT_INTERLEAVED) {
+		names[0] = pass_alpha ? "histogram_alpha" : "histogram_interleaved";
+		names[3] = pass_alpha ? "project_alpha" : "project_interleaved";
+	}
+	double launch_ms[6][2];
+	for (int pass = 0; pass < 2; pass++) {
+		queue.enqueueFillBuffer(dev_intensity_histogram.Get(), 0, 0, histogram_size * sizeof(int));
+		queue.finish();
+
+		auto start = std::chrono::steady_clock::now();
+		EnqueueHistogram(programs, queue, kernel_layout, dev_image_input.Get(), dev_intensity_histogram.Get(), width, height, spectrum, nullptr, pass_alpha);
+		queue.finish();
+		launch_ms[0][pass] = ElapsedMs(start);
+
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < channels; i++)
+			queue.enqueueNDRangeKernel(cumulativeHistKernel.Kernel(), cl::NDRange(256 * i), cl::NDRange(256), cl::NullRange);
+		queue.finish();
+		launch_ms[1][pass] = ElapsedMs(start);
+
+		start = std::chrono::steady_clock::now();
+		queue.enqueueNDRangeKernel(normalise.Kernel(), cl::NullRange, cl::NDRange(histogram_size), cl::NullRange);
+		queue.finish();
+		launch_ms[2][pass] = ElapsedMs(start);
+
+		start = std::chrono::steady_clock::now();
+		EnqueueProjection(programs, queue, kernel_layout, dev_image_input.Get(), dev_normalised_histogram.Get(), dev_image_output.Get(), width, height, spectrum,
+			nullptr, pass_alpha);
+		queue.finish();
+		launch_ms[3][pass] = ElapsedMs(start);
+
+		if (deinterleave) {
+			start = std::chrono::steady_clock::now();
+			EnqueueLayoutConversion(programs, queue, "deinterleave", dev_image_input.Get(), dev_image_output.Get(), width * height, spectrum);
+			queue.finish();
+			launch_ms[4][pass] = ElapsedMs(start);
+		}
+		if (interleave) {
+			start = std::chrono::steady_clock::now();
+			EnqueueLayoutConversion(programs, queue, "interleave", dev_image_input.Get(), dev_image_output.Get(), width * height, spectrum);
+			queue.finish();
+			launch_ms[5][pass] = ElapsedMs(start);
+		}
+	}
+
+	stringstream sstream;
+	sstream << "Warm-up (" << width << "x" << height << "x" << spectrum << " dummy image):" << endl;
+	for (int k = 0; k < 6; k++)
+		if (launched[k])
+			sstream << "   " << names[k] << ": cold [ms]: " << launch_ms[k][0] << ", warm [ms]: " << launch_ms[k][1]
+				<< ", delta [ms]: " << launch_ms[k][0] - launch_ms[k][1] << endl;
+	return sstream.str();
+}
+
+#ifdef ENABLE_SVM
+//the same pipeline on coarse-grained shared virtual memory: the images and histograms are SVM allocations
+//passed to the kernels as plain pointers, and map/unmap replaces the buffer reads and writes
+void EqualiseImageSvm(const CImg<unsigned char>& image_input, CImg<unsigned char>& image_output, ProgramLibrary& programs,
+	cl::CommandQueue& queue, ImageLayout layout, bool pass_alpha = false, const int* intensity_histogram = nullptr,
+	const function<void(const unsigned char*)>& write_output = nullptr) {
+	cl::Context context = queue.getInfo<CL_QUEUE_CONTEXT>();
+	int channels = pass_alpha ? image_input.spectrum() - 1 : image_input.spectrum();
+	size_t histogram_size = 256 * channels;
+
+	SvmBuffer<unsigned char> svm_image_input(context, image_input.size(), CL_MEM_READ_ONLY);
+	SvmBuffer<unsigned char> svm_image_output(context, image_output.size(), CL_MEM_WRITE_ONLY);
+	SvmBuffer<int> svm_intensity_histogram(context, histogram_size);
+	SvmBuffer<int> svm_cumulative_histogram(context, histogram_size);
+	SvmBuffer<int> svm_normalised_histogram(context, histogram_size);
+	SvmBuffer<int> svm_divideby(context, 1);
+
+	//4.1 the host writes the image straight into shared memory
+	memcpy(svm_image_input.Map(queue, CL_MAP_WRITE_INVALIDATE_REGION), image_input.data(), image_input.size());
+	svm_image_input.Unmap(queue);
+
+	cl::Event profile_event;
+	int pixel_count = image_input.width() * image_input.height();
+	ImageLayout kernel_layout = layout;
+	unsigned char* kernel_input = svm_image_input.Get();
+	unsigned char* kernel_output = svm_image_output.Get();
+	SvmBuffer<unsigned char> svm_planar_input, svm_planar_output;
+	if (layout == LAYOUT_DEVICE_CONVERT) {
+		svm_planar_input = SvmBuffer<unsigned char>(context, image_input.size());
+		svm_planar_output = SvmBuffer<unsigned char>(context, image_output.size());
+		kernel_input = svm_planar_input.Get();
+		kernel_output = svm_planar_output.Get();
+		kernel_layout = LAYOUT_PLANAR;
+		EnqueueLayoutConversion(programs, queue, "deinterleave", svm_image_input.Get(), kernel_input, pixel_count, image_input.spectrum(), &profile_event);
+		std::cout << "Deinterleave complete" << std::endl;
+		queue.finish();
+		PrintKernelProfile(profile_event);
+	}
+
+	//  STEP 1 :: Generate Intensity Histogram
+	if (intensity_histogram) {
+		memcpy(svm_intensity_histogram.Map(queue, CL_MAP_WRITE_INVALIDATE_REGION), intensity_histogram, svm_intensity_histogram.Bytes());
+		svm_intensity_histogram.Unmap(queue);
+		std::cout << "Intensity histogram precomputed" << std::endl;
+	}
+	else {
+		queue.enqueueMemFillSVM(svm_intensity_histogram.Get(), 0, svm_intensity_histogram.Bytes());
+		EnqueueHistogram(programs, queue, kernel_layout, kernel_input, svm_intensity_histogram.Get(), image_input.width(), image_input.height(), image_input.spectrum(),
+			&profile_event, pass_alpha);
+		std::cout << "Intensity histogram complete" << std::endl;
+		queue.finish();
+		PrintKernelProfile(profile_event);
+	}
+
+	//  STEP 2 :: Calculate cumulative histogram
+	BoundKernel& cumulativeHistKernel = programs.Kernel("equalisation", "scan_add");
+	cumulativeHistKernel.Bind(0, svm_intensity_histogram.Get());
+	cumulativeHistKernel.Bind(1, svm_cumulative_histogram.Get());
+	cumulativeHistKernel.Bind(2, cl::Local(histogram_size * sizeof(int)));
+	cumulativeHistKernel.Bind(3, cl::Local(histogram_size * sizeof(int)));
+	for (int i = 0; i < channels; i++)
+	{
+		queue.enqueueNDRangeKernel(cumulativeHistKernel.Kernel(), cl::NDRange(256 * i), cl::NDRange(256), cl::NullRange, NULL, &profile_event);
+		std::cout << "Cumulative Histogram " << i << std::endl;
+		queue.finish();
+		PrintKernelProfile(profile_event);
+	}
+	std::cout << "Cumulative Histogram Complete" << std::endl;
+
+	//  STEP 3 :: Normalise histogram
+	//		find max, reading the cumulative histogram in place
+	const int* cumulative_histogram = svm_cumulative_histogram.Map(queue, CL_MAP_READ);
+	int max = cumulative_histogram[histogram_size - 1];
+	for (int i = 0; i < channels; i++)
+		max = std::max(max, cumulative_histogram[(256 * (i + 1)) - 1]);
+	svm_cumulative_histogram.Unmap(queue);
+	*svm_divideby.Map(queue, CL_MAP_WRITE_INVALIDATE_REGION) = max;
+	svm_divideby.Unmap(queue);
+
+	BoundKernel& normalise = programs.Kernel("equalisation", "divide");
+	normalise.Bind(0, svm_cumulative_histogram.Get());
+	normalise.Bind(1, svm_normalised_histogram.Get());
+	normalise.Bind(2, svm_divideby.Get());
+	queue.enqueueNDRangeKernel(normalise.Kernel(), cl::NullRange, cl::NDRange(histogram_size), cl::NullRange, NULL, &profile_event);
+	std::cout << "Normalised Histogram" << std::endl;
+	queue.finish();
+	PrintKernelProfile(profile_event);
+
+	//  STEP 4 :: Back-projection using lut
+	EnqueueProjection(programs, queue, kernel_layout, kernel_input, svm_normalised_histogram.Get(), kernel_output,
+		image_input.width(), image_input.height(), image_input.spectrum(), &profile_event, pass_alpha);
+	if (pass_alpha && kernel_layout == LAYOUT_PLANAR) {
+		size_t alpha_offset = (size_t)channels * pixel_count;
+		queue.enqueueMemcpySVM(kernel_output + alpha_offset, kernel_input + alpha_offset, CL_FALSE, pixel_count);
+	}
+	std::cout << "Back-projection Complete" << std::endl;
+	queue.finish();
+	PrintKernelProfile(profile_event);
+
+	if (layout == LAYOUT_DEVICE_CONVERT) {
+		EnqueueLayoutConversion(programs, queue, "interleave", kernel_output, svm_image_output.Get(), pixel_count, image_input.spectrum(), &profile_event);
+		std::cout << "Interleave complete" << std::endl;
+		queue.finish();
+		PrintKernelProfile(profile_event);
+	}
+
+	//4.3 mapping makes the device's writes visible to the host
+	memcpy(image_output.data(), svm_image_output.Map(queue, CL_MAP_READ), image_output.size());
+	svm_image_output.Unmap(queue);
+
+	//planar colour results are interleaved for write_output on the device, into shared memory it reads in place
+	if (write_output && layout == LAYOUT_PLANAR && image_output.spectrum() > 1) {
+		SvmBuffer<unsigned char> svm_interleaved(context, image_output.size(), CL_MEM_WRITE_ONLY);
+		EnqueueLayoutConversion(programs, queue, "interleave", svm_image_output.Get(), svm_interleaved.Get(), pixel_count, image_output.spectrum());
+		write_output(svm_interleaved.Map(queue, CL_MAP_READ));
+		svm_interleaved.Unmap(queue);
+	}
+	else if (write_output) {
+		write_output(image_output.data());
+	}
+	//the allocations are freed on return, so nothing may still be using them
+	queue.finish();
+}
+#endif
+
+//per-frame resources of the stream pipeline, each slot holds one frame from reading to writing
+struct StreamSlot {
+	cl::CommandQueue queue;
+	StagingBuffer frame; //the whole frame, the equalised planes are downloaded over the input
+	cl::Buffer dev_image_input, dev_image_output;
+	cl::Buffer dev_intensity_histogram, dev_cumulative_histogram, dev_normalised_histogram, dev_divideby;
+	cl::Event done;
+	string frame_header;
+};
+
+//equalises a stream of frames from input to output until the input ends, returns the throughput
+//a reader thread, the calling thread (enqueueing) and a writer thread pass slot_count slots around, so reading,
+//upload, kernels, download and writing of successive frames overlap and memory stays bounded for any stream length.
+//each slot has its own queue, so the device can also overlap one frame's transfers with another frame's kernels.
+string EqualiseStream(FILE* input, FILE* output, const FrameFormat& format, ProgramLibrary& programs, const cl::Context& context,
+	DeviceMemoryTracker& tracker, int slot_count = 3) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	size_t image_size = format.EqualisedBytes();
+	size_t histogram_size = 256 * format.spectrum;
+	//every channel holds width*height samples, so the largest cumulative count is known up front
+	//and a frame never has to come back to the host between the kernels
+	int max = format.width * format.height;
+
+	tracker.SetStage("stream");
+	vector<StreamSlot> slots(slot_count);
+	for (StreamSlot& slot : slots) {
+		slot.queue = cl::CommandQueue(context, device);
+		slot.frame.Reserve(context, slot.queue, format.frame_bytes);
+		slot.dev_image_input = tracker.CreateBuffer(context, CL_MEM_READ_ONLY, image_size);
+		slot.dev_image_output = tracker.CreateBuffer(context, CL_MEM_READ_WRITE, image_size);
+		slot.dev_intensity_histogram = tracker.CreateBuffer(context, CL_MEM_READ_WRITE, histogram_size * sizeof(int));
+		slot.dev_cumulative_histogram = tracker.CreateBuffer(context, CL_MEM_READ_WRITE, histogram_size * sizeof(int));
+		slot.dev_normalised_histogram = tracker.CreateBuffer(context, CL_MEM_READ_WRITE, histogram_size * sizeof(int));
+		slot.dev_divideby = tracker.CreateBuffer(context, CL_MEM_READ_ONLY, sizeof(int));
+		slot.queue.enqueueWriteBuffer(slot.dev_divideby, CL_TRUE, 0, sizeof(int), &max);
+	}
+
+	if (format.y4m)
+		fprintf(output, "%s\n", format.stream_header.c_str());
+
+	BlockingQueue<int> free_slots, filled_slots, busy_slots;
+	for (int i = 0; i < slot_count; i++)
+		free_slots.Push(i);
+
+	auto start = std::chrono::steady_clock::now();
+	thread reader([&]() {
+		int slot;
+		while (free_slots.Pop(slot) && ReadFrame(input, format, slots[slot].frame_header, slots[slot].frame.Data()))
+			filled_slots.Push(slot);
+		filled_slots.Close();
+	});
+
+	unsigned long long frames = 0;
+	bool write_failed = false;
+	thread writer([&]() {
+		int slot;
+		while (busy_slots.Pop(slot)) {
+			slots[slot].done.wait();
+			if (!write_failed && WriteFrame(output, format, slots[slot].frame_header, slots[slot].frame.Data())) {
+				frames++;
+				free_slots.Push(slot);
+			}
+			else if (!write_failed) {
+				//the reader of the pipe went away, stop reading and drain the frames in flight
+				write_failed = true;
+				free_slots.Close();
+			}
+		}
+		fflush(output);
+	});
+
+	try {
+		int slot;
+		while (filled_slots.Pop(slot)) {
+			StreamSlot& frame = slots[slot];
+			cl::CommandQueue& queue = frame.queue;
+			queue.enqueueWriteBuffer(frame.dev_image_input, CL_FALSE, 0, image_size, frame.frame.Data());
+			queue.enqueueFillBuffer(frame.dev_intensity_histogram, 0, 0, histogram_size * sizeof(int));
+			EnqueueHistogram(programs, queue, LAYOUT_PLANAR, frame.dev_image_input, frame.dev_intensity_histogram, format.width, format.height, format.spectrum);
+
+			BoundKernel& cumulativeHistKernel = programs.Kernel("equalisation", "scan_add");
+			cumulativeHistKernel.Bind(0, frame.dev_intensity_histogram);
+			cumulativeHistKernel.Bind(1, frame.dev_cumulative_histogram);
+			cumulativeHistKernel.Bind(2, cl::Local(histogram_size * sizeof(int)));
+			cumulativeHistKernel.Bind(3, cl::Local(histogram_size * sizeof(int)));
+			for (int i = 0; i < format.spectrum; i++)
+				queue.enqueueNDRangeKernel(cumulativeHistKernel.Kernel(), cl::NDRange(256 * i), cl::NDRange(256), cl::NullRange);
+
+			BoundKernel& normalise = programs.Kernel("equalisation", "divide");
+			normalise.Bind(0, frame.dev_cumulative_histogram);
+			normalise.Bind(1, frame.dev_normalised_histogram);
+			normalise.Bind(2, frame.dev_divideby);
+			queue.enqueueNDRangeKernel(normalise.Kernel(), cl::NullRange, cl::NDRange(histogram_size), cl::NullRange);
+
+			EnqueueProjection(programs, queue, LAYOUT_PLANAR, frame.dev_image_input, frame.dev_normalised_histogram, frame.dev_image_output,
+				format.width, format.height, format.spectrum);
+			queue.enqueueReadBuffer(frame.dev_image_output, CL_FALSE, 0, image_size, frame.frame.Data(), NULL, &frame.done);
+			queue.flush();
+			busy_slots.Push(slot);
+		}
+	}
+	catch (...) {
+		//let the other stages finish before the slots go away
+		//the reader stops at the next frame boundary, but a read already in progress is not interrupted: on an idle input
+		//pipe the join waits until the next frame arrives or the writing end is closed
+		free_slots.Close();
+		busy_slots.Close();
+		reader.join();
+		writer.join();
+		throw;
+	}
+	busy_slots.Close();
+	reader.join();
+	writer.join();
+	double ms = ElapsedMs(start);
+
+	stringstream sstream;
+	sstream << "Stream: " << frames << " frames of " << format.width << "x" << format.height << " (" << format.frame_bytes << " B), "
+		<< (ms > 0.0 ? frames / (ms / 1000.0) : 0.0) << " frames/s, " << TransferRate(frames * format.frame_bytes, ms) << " MB/s"
+		<< (write_failed ? ", output closed early" : "") << endl;
+	return sstream.str();
+}
+
+//per-slab resources of the volume pipeline
+struct VolumeSlot {
+	cl::CommandQueue queue;
+	PooledBuffer dev_slab_input, dev_slab_output, dev_intensity_histogram;
+	StagingBuffer slab; //the equalised slab, downloaded for writing
+	cl::Event done;
+	int first_slice = 0;
+	int slices = 0; //0 while no slab is in flight
+	size_t counted = 0; //voxels per channel in dev_intensity_histogram since it was last read back
+};
+
+//equalises a volume (depth slices of width x height, in the given layout) with one histogram per channel over all slices,
+//writing the result to output_file as an image cache unless it is empty; returns the throughput
+//the volume is streamed through two slots of fixed-size slabs, so memory does not grow with the depth: each slot holds a
+//device input, device output and host staging slab, and all six fit into memory_bytes unless a single slice does not.
+//pass 1 counts the histogram slab by slab, pass 2 projects each slab through the lut and writes it out. a slab holds its
+//slices as a width x (height * slices) image in the volume's layout, so the 2D kernels run on it unchanged, and each slot
+//has its own queue so that one slab's transfers overlap the other's kernels.
+//a precomputed intensity histogram (e.g. from an image cache) replaces pass 1
+string EqualiseVolume(const unsigned char* input, int width, int height, int depth, int spectrum, ImageCacheLayout layout, const string& output_file,
+	ProgramLibrary& programs, const cl::Context& context, BufferPool& pool, DeviceMemoryTracker& tracker, size_t memory_bytes,
+	const int32_t* intensity_histogram = nullptr) {
+	cl::Device device = context.getInfo<CL_CONTEXT_DEVICES>()[0];
+	ImageLayout kernel_layout = layout == IMAGE_CACHE_PLANAR ? LAYOUT_PLANAR : LAYOUT_INTERLEAVED;
+	size_t slice_pixels = (size_t)width * height;
+	size_t voxel_count = slice_pixels * depth;
+	size_t slice_bytes = slice_pixels * spectrum;
+	//the kernels index a slab with ints
+	const int slab_buffers = 6;
+	size_t slab_bytes = min(memory_bytes / slab_buffers, (size_t)numeric_limits<int>::max());
+	int slab_slices = (int)min((size_t)depth, max((size_t)1, slab_bytes / slice_bytes));
+	int slab_count = (depth + slab_slices - 1) / slab_slices;
+	size_t histogram_size = 256 * spectrum;
+
+	//a slab is copied in one run of bytes per slice range of an interleaved volume and one per channel of a planar one,
+	//run c of slices [first, first + n) lives at c * voxel_count + first * run_bytes in the volume and at c * n * run_bytes in the slab
+	int run_count = layout == IMAGE_CACHE_PLANAR ? spectrum : 1;
+	size_t run_bytes = layout == IMAGE_CACHE_PLANAR ? slice_pixels : slice_bytes;
+
+	tracker.SetStage("volume");
+	VolumeSlot slots[2];
+	for (VolumeSlot& slot : slots) {
+		slot.queue = cl::CommandQueue(context, device);
+		slot.dev_slab_input = pool.Acquire(slab_slices * slice_bytes, CL_MEM_READ_ONLY);
+		slot.dev_slab_output = pool.Acquire(slab_slices * slice_bytes, CL_MEM_READ_WRITE);
+		slot.dev_intensity_histogram = pool.Acquire(histogram_size * sizeof(int));
+		slot.slab.Reserve(context, slot.queue, slab_slices * slice_bytes);
+	}
+	PooledBuffer dev_lut = pool.Acquire(histogram_size * sizeof(int), CL_MEM_READ_ONLY);
+
+	auto upload = [&](VolumeSlot& slot) {
+		for (int c = 0; c < run_count; c++)
+			slot.queue.enqueueWriteBuffer(slot.dev_slab_input.Get(), CL_FALSE, c * slot.slices * run_bytes, slot.slices * run_bytes,
+				input + c * voxel_count + slot.first_slice * run_bytes);
+	};
+
+	//  PASS 1 :: Intensity histogram over all slices
+	//		counted in 64-bit on the host, since a volume can have more voxels than an int bin holds
+	vector<unsigned long long> histogram(histogram_size, 0);
+	auto read_histogram = [&](VolumeSlot& slot) {
+		vector<int> counts(histogram_size);
+		slot.queue.enqueueReadBuffer(slot.dev_intensity_histogram.Get(), CL_TRUE, 0, histogram_size * sizeof(int), counts.data());
+		for (size_t i = 0; i < histogram_size; i++)
+			histogram[i] += counts[i];
+		slot.queue.enqueueFillBuffer(slot.dev_intensity_histogram.Get(), 0, 0, histogram_size * sizeof(int));
+		slot.counted = 0;
+	};
+
+	auto start = std::chrono::steady_clock::now();
+	//		the int32 bins of a cached histogram can only be trusted if none of them can have overflowed
+	bool precomputed = intensity_histogram && voxel_count <= (size_t)numeric_limits<int32_t>::max();
+	if (precomputed) {
+		for (size_t i = 0; i < histogram_size; i++)
+			histogram[i] = intensity_histogram[i];
+	}
+	else {
+		for (VolumeSlot& slot : slots)
+			slot.queue.enqueueFillBuffer(slot.dev_intensity_histogram.Get(), 0, 0, histogram_size * sizeof(int));
+		for (int slab = 0; slab < slab_count; slab++) {
+			VolumeSlot& slot = slots[slab % 2];
+			slot.first_slice = slab * slab_slices;
+			slot.slices = min(slab_slices, depth - slot.first_slice);
+			size_t slab_voxels = slot.slices * slice_pixels;
+			//the device histogram is emptied into the host one before any of its bins could overflow
+			if (slot.counted + slab_voxels > (size_t)numeric_limits<int>::max())
+				read_histogram(slot);
+			upload(slot);
+			EnqueueHistogram(programs, slot.queue, kernel_layout, slot.dev_slab_input.Get(), slot.dev_intensity_histogram.Get(), width, height * slot.slices, spectrum);
+			slot.counted += slab_voxels;
+			slot.queue.flush();
+		}
+		for (VolumeSlot& slot : slots) {
+			read_histogram(slot);
+			slot.slices = 0;
+		}
+	}
+	double histogram_ms = ElapsedMs(start);
+
+	//  cumulative histogram and lut, 256 bins per channel computed on the host for the same reason, with the rounding
+	//  of the divide kernel (every channel of the volume has voxel_count voxels)
+	vector<int> lut(histogram_size);
+	vector<int32_t> output_histogram(histogram_size, 0);
+	for (int c = 0; c < spectrum; c++) {
+		unsigned long long cumulative = 0;
+		for (int v = 0; v < 256; v++) {
+			cumulative += histogram[c * 256 + v];
+			lut[c * 256 + v] = (int)((cumulative * 255) / voxel_count);
+			output_histogram[c * 256 + lut[c * 256 + v]] += (int32_t)histogram[c * 256 + v];
+		}
+	}
+	slots[0].queue.enqueueWriteBuffer(dev_lut.Get(), CL_TRUE, 0, histogram_size * sizeof(int), lut.data());
+
+	//the output histogram follows from the lut, so the cache header can be written before the first slab
+	ImageCacheWriter writer;
+	bool writing = !output_file.empty() && writer.Open(output_file, width, height, depth, spectrum, layout, output_histogram.data());
+	bool write_failed = !output_file.empty() && !writing;
+	auto write_slab = [&](VolumeSlot& slot) {
+		slot.done.wait();
+		for (int c = 0; c < run_count && writing; c++) {
+			if (!writer.Write(c * voxel_count + slot.first_slice * run_bytes, slot.slab.Data() + c * slot.slices * run_bytes, slot.slices * run_bytes))
+				write_failed = true;
+		}
+		slot.slices = 0;
+	};
+
+	//  PASS 2 :: Back-projection slab by slab
+	start = std::chrono::steady_clock::now();
+	for (int slab = 0; slab < slab_count; slab++) {
+		VolumeSlot& slot = slots[slab % 2];
+		//the slot's previous slab is written out while the other slot's slab is on the device
+		if (slot.slices)
+			write_slab(slot);
+		slot.first_slice = slab * slab_slices;
+		slot.slices = min(slab_slices, depth - slot.first_slice);
+		upload(slot);
+		EnqueueProjection(programs, slot.queue, kernel_layout, slot.dev_slab_input.Get(), dev_lut.Get(), slot.dev_slab_output.Get(), width, height * slot.slices, spectrum);
+		slot.queue.enqueueReadBuffer(slot.dev_slab_output.Get(), CL_FALSE, 0, slot.slices * slice_bytes, slot.slab.Data(), NULL, &slot.done);
+		slot.queue.flush();
+	}
+	for (int slab = slab_count; slab < slab_count + 2; slab++) {
+		if (slots[slab % 2].slices)
+			write_slab(slots[slab % 2]);
+	}
+	if (writing && !writer.Close())
+		write_failed = true;
+	double projection_ms = ElapsedMs(start);
+
+	stringstream sstream;
+	sstream << "Volume: " << width << "x" << height << "x" << depth << "x" << spectrum << " in " << slab_count << " slabs of " << slab_slices
+		<< " slices (" << slab_slices * slice_bytes << " B, " << slab_buffers * slab_slices * slice_bytes << " B of slab buffers), histogram " << (precomputed ? "precomputed" : to_string(histogram_ms) + " ms")
+		<< ", projection " << projection_ms << " ms, " << TransferRate(voxel_count * spectrum, histogram_ms + projection_ms) << " MB/s"
+		<< (write_failed ? ", output " + output_file + " could not be written" : "") << endl;
+	return sstream.str();
+}
+
+//output file of image_id in a batch: the name as given for a single image, otherwise numbered before the extension
+string OutputFileName(const string& file_name, unsigned int image_id, size_t image_count) {
+	if (image_count == 1)
+		return file_name;
+	size_t dot = file_name.find_last_of('.');
+	size_t slash = file_name.find_last_of("/\\");
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		dot = file_name.size();
+	return file_name.substr(0, dot) + "_" + to_string(image_id) + file_name.substr(dot);
+}
+
+//parses a whole unsigned decimal number, false for signs, trailing characters, overflow or an empty string
+bool ParseUnsigned(const char* text, unsigned long long& value) {
+	if (!isdigit((unsigned char)text[0]))
+		return false;
+	char* end;
+	errno = 0;
+	value = strtoull(text, &end, 10);
+	return errno == 0 && *end == '\0';
+}
+
 int main(int argc, char** argv) {
 	//Part 1 - handle command line options such as device selection, verbosity, etc.
 	int platform_id = 0;
 	int device_id = 0;
-	string image_filename = "test.ppm";
+	vector<string> image_filenames;
+	bool display = true;
+	string output_filename = "";
+	unsigned int output_chunks = 1;
+	string cache_output_filename = "";
+	bool use_batch_io = false;
+	bool pass_alpha = false;
+	bool stream_y4m = false;
+	size_t volume_slab_mb = 0;
+	int raw_width = 0, raw_height = 0, raw_spectrum = 0;
+	size_t pool_cap_mb = 0;
+	bool allow_zero_copy = true;
+	bool allow_pinned = true;
+	bool allow_svm = true;
+	bool benchmark_transfers = false;
+	HostMemoryPolicy host_policy;
+	bool benchmark_host_memory = false;
+	bool warm_up = false;
+	ImageLayout layout = LAYOUT_PLANAR;
+	string cache_dir = "kernel_cache";
+	string kernel_dir = "";
 
 	for (int i = 1; i < argc; i++) {
 		if ((strcmp(argv[i], "-p") == 0) && (i < (argc - 1))) { platform_id = atoi(argv[++i]); }
 		else if ((strcmp(argv[i], "-d") == 0) && (i < (argc - 1))) { device_id = atoi(argv[++i]); }
 		else if (strcmp(argv[i], "-l") == 0) { std::cout << ListPlatformsDevices() << std::endl; }
-		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-f") == 0) && (i < (argc - 1))) { image_filenames.push_back(argv[++i]); }
+		else if (strcmp(argv[i], "-n") == 0) { display = false; }
+		else if ((strcmp(argv[i], "-o") == 0) && (i < (argc - 1))) { output_filename = argv[++i]; }
+		else if (strcmp(argv[i], "-y4m") == 0) { stream_y4m = true; }
+		else if ((strcmp(argv[i], "-raw") == 0) && (i < (argc - 3))) {
+			//the kernels index a frame's pixels with ints
+			unsigned long long size[3];
+			for (int k = 0; k < 3; k++) {
+				if (!ParseUnsigned(argv[++i], size[k]) || size[k] == 0 || size[k] > (unsigned long long)numeric_limits<int>::max()) {
+					std::cerr << "ERROR: -raw expects a positive width, height and number of channels, not " << argv[i] << std::endl;
+					return 1;
+				}
+			}
+			if (size[0] * size[1] > (unsigned long long)numeric_limits<int>::max()) {
+				std::cerr << "ERROR: -raw frames of " << size[0] << "x" << size[1] << " pixels are too large" << std::endl;
+				return 1;
+			}
+			raw_width = (int)size[0];
+			raw_height = (int)size[1];
+			raw_spectrum = (int)size[2];
+		}
+		else if ((strcmp(argv[i], "-vol") == 0) && (i < (argc - 1))) {
+			unsigned long long megabytes;
+			if (!ParseUnsigned(argv[++i], megabytes) || megabytes == 0 || megabytes > numeric_limits<size_t>::max() / (1024 * 1024)) {
+				std::cerr << "ERROR: -vol expects a positive slab memory budget in MB, not " << argv[i] << std::endl;
+				return 1;
+			}
+			volume_slab_mb = (size_t)megabytes;
+		}
+		else if (strcmp(argv[i], "-bio") == 0) { use_batch_io = true; }
+		else if (strcmp(argv[i], "-pa") == 0) { pass_alpha = true; }
+		else if ((strcmp(argv[i], "-wc") == 0) && (i < (argc - 1))) { cache_output_filename = argv[++i]; }
+		else if ((strcmp(argv[i], "-oc") == 0) && (i < (argc - 1))) {
+			unsigned long long chunks;
+			if (!ParseUnsigned(argv[++i], chunks) || chunks == 0) {
+				std::cerr << "ERROR: -oc expects a positive number of chunks, not " << argv[i] << std::endl;
+				return 1;
+			}
+			//each chunk is written by its own thread, more than there are hardware threads only adds overhead
+			output_chunks = (unsigned int)min(chunks, (unsigned long long)max(1u, thread::hardware_concurrency()));
+		}
+		else if ((strcmp(argv[i], "-m") == 0) && (i < (argc - 1))) {
+			unsigned long long megabytes;
+			if (!ParseUnsigned(argv[++i], megabytes) || megabytes > numeric_limits<size_t>::max() / (1024 * 1024)) {
+				std::cerr << "ERROR: -m expects a memory cap in MB, not " << argv[i] << std::endl;
+				return 1;
+			}
+			pool_cap_mb = (size_t)megabytes;
+		}
+		else if (strcmp(argv[i], "-nz") == 0) { allow_zero_copy = false; }
+		else if (strcmp(argv[i], "-np") == 0) { allow_pinned = false; }
+		else if (strcmp(argv[i], "-ns") == 0) { allow_svm = false; }
+		else if (strcmp(argv[i], "-bt") == 0) { benchmark_transfers = true; }
+		else if ((strcmp(argv[i], "-numa") == 0) && (i < (argc - 1))) {
+			unsigned long long node;
+			if (!ParseUnsigned(argv[++i], node) || node > (unsigned long long)numeric_limits<int>::max()) {
+				std::cerr << "ERROR: -numa expects a NUMA node number, not " << argv[i] << std::endl;
+				return 1;
+			}
+			host_policy.numa_node = (int)node;
+		}
+		else if (strcmp(argv[i], "-hp") == 0) { host_policy.huge_pages = true; }
+		else if (strcmp(argv[i], "-bh") == 0) { benchmark_host_memory = true; }
+		else if (strcmp(argv[i], "-w") == 0) { warm_up = true; }
+		else if ((strcmp(argv[i], "-layout") == 0) && (i < (argc - 1))) {
+			i++;
+			layout = strcmp(argv[i], "interleaved") == 0 ? LAYOUT_INTERLEAVED : (strcmp(argv[i], "device") == 0 ? LAYOUT_DEVICE_CONVERT : LAYOUT_PLANAR);
+		}
+		else if ((strcmp(argv[i], "-c") == 0) && (i < (argc - 1))) { cache_dir = argv[++i]; }
+		else if (strcmp(argv[i], "-nc") == 0) { cache_dir = ""; }
+		else if ((strcmp(argv[i], "-k") == 0) && (i < (argc - 1))) { kernel_dir = argv[++i]; }
 		else if (strcmp(argv[i], "-h") == 0) { print_help(); return 0; }
 	}
 
+	//in stream mode stdout carries the frames, so everything that is normally printed goes to stderr instead
+	bool streaming = stream_y4m || (raw_width > 0 && raw_height > 0 && raw_spectrum > 0);
+	std::streambuf* cout_buffer = std::cout.rdbuf();
+	if (streaming) {
+		std::cout.rdbuf(std::cerr.rdbuf());
+		display = false;
+	}
+
+	if (image_filenames.empty() && !streaming)
+		image_filenames.push_back("test.ppm");
+
+	//in volume mode each input is processed as a whole stack, not by the per-image pipeline
+	vector<string> volume_filenames;
+	if (volume_slab_mb > 0) {
+		volume_filenames.swap(image_filenames);
+		display = false;
+	}
+
 	cimg::exception_mode(0);
 
 	//detect any potential exceptions
 	try {
-		CImg<unsigned char> image_input(image_filename.c_str());
-		CImgDisplay disp_input(image_input, "input");
-
-		//a 3x3 convolution mask implementing an averaging filter
-		std::vector<float> convolution_mask = { 1.f / 9, 1.f / 9, 1.f / 9,
-												1.f / 9, 1.f / 9, 1.f / 9,
-												1.f / 9, 1.f / 9, 1.f / 9 };
-
 		//Part 3 - host operations
 		//3.1 Select computing devices
+		//device enumeration happens once, in the registry behind GetContext and the naming calls
 		cl::Context context = GetContext(platform_id, device_id);
 
 		//display the selected device
 		std::cout << "Running on " << GetPlatformName(platform_id) << ", " << GetDeviceName(platform_id, device_id) << std::endl;
 
+		//a CPU device is narrowed to the sub-device of the chosen NUMA node, so its workers read node-local host memory
+		cl::Device numa_device;
+		if (GetNumaSubDevice(DeviceRegistry::Get().Device(platform_id, device_id).device, host_policy.numa_node, numa_device)) {
+			context = cl::Context(numa_device);
+			std::cout << "Using the sub-device of NUMA node " << host_policy.numa_node << std::endl;
+		}
+
+		auto startup_phase = std::chrono::steady_clock::now();
 		//create a queue to which we will push commands for the device
 		cl::CommandQueue queue(context, CL_QUEUE_PROFILING_ENABLE);
+		GetStartupProfile().Record("queue creation", ElapsedMs(startup_phase));
+
+		//all device buffers are counted by the tracker; it is declared before the programs and the pool, which are
+		//destroyed first, so the buffers their kernels and free lists still hold are released while it exists
+		DeviceMemoryTracker tracker(queue.getInfo<CL_QUEUE_DEVICE>());
 
 		//3.2 Load & build the device code
-		cl::Program::Sources sources;
-
-		AddSources(sources, "kernels.cl");
-
-		cl::Program program(context, sources);
-
-		//build and debug the kernel code
-		try {
-			program.build();
-		}
-		catch (const cl::Error& err) {
-			std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(context.getInfo<CL_CONTEXT_DEVICES>()[0]) << std::endl;
-			throw err;
-		}
-
-		//device - buffers
-		cl::Buffer dev_image_input(context, CL_MEM_READ_ONLY, image_input.size());
-		cl::Buffer dev_image_output(context, CL_MEM_READ_WRITE, image_input.size()); //should be the same as input image
-
-				//4.1 Copy images to device memory
-		queue.enqueueWriteBuffer(dev_image_input, CL_TRUE, 0, image_input.size(), &image_input.data()[0]);
-		
-
-		//  STEP 1 :: Generate Intensity Histogram
-		//		buffers
-		std::vector<int> cumulative_histogram(256 * image_input.spectrum(), 0);
-		std::vector<int> normalised_histogram(256 * image_input.spectrum(), 0);
-		std::vector<int> max_hist(256 * image_input.spectrum(), 0);
-		cl::Buffer dev_cumulative_histogram(context, CL_MEM_READ_WRITE, cumulative_histogram.size() * sizeof(int));
-		cl::Buffer dev_max_histogram(context, CL_MEM_READ_WRITE, max_hist.size() * sizeof(int));
-		std::vector<int> intensity_histogram(256 * image_input.spectrum(), 0);
-		cl::Buffer dev_intensity_histogram(context, CL_MEM_READ_WRITE, intensity_histogram.size() * sizeof(int));
-		//		kernel
-		cl::Kernel ihistKernel = cl::Kernel(program, "histogram255");
-		ihistKernel.setArg(0, dev_image_input);
-		ihistKernel.setArg(1, dev_intensity_histogram);
-		cl::Event profile_event;
-		queue.enqueueNDRangeKernel(ihistKernel, cl::NullRange, cl::NDRange(image_input.width(), image_input.height(), image_input.spectrum()), cl::NullRange, NULL, &profile_event);
-		//		read
-		std::cout << "Intensity histogram complete" << std::endl;
-		clFinish(queue.get());
-		std::cout << "Kernel execution time [ns]: " << profile_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - profile_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-		std::cout << GetFullProfilingInfo(profile_event, ProfilingResolution::PROF_US) << std::endl;
-
-		//  STEP 2 :: Calculate cumulative histogram
-		
-		cl::Kernel cumulativeHistKernel = cl::Kernel(program, "scan_add");
-		cumulativeHistKernel.setArg(0, dev_intensity_histogram);
-		cumulativeHistKernel.setArg(1, dev_cumulative_histogram);
-		cumulativeHistKernel.setArg(2, cl::Local(intensity_histogram.size() * sizeof(int)));
-		cumulativeHistKernel.setArg(3, cl::Local(intensity_histogram.size() * sizeof(int)));
-		//		run kernel once for each colour channel (eg: once for greyscale or 3 times for rgb).
-		//		works out offset and size (only works for 256 colour values)
-		for (int i = 0; i < image_input.spectrum(); i++)
-		{
-			queue.enqueueNDRangeKernel(cumulativeHistKernel, cl::NDRange(256 * i), cl::NDRange(256), cl::NullRange, NULL, &profile_event);
-			std::cout << "Cumulative Histogram " << i << std::endl;
-			clFinish(queue.get());
-			std::cout << "Kernel execution time [ns]: " << profile_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - profile_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-			std::cout << GetFullProfilingInfo(profile_event, ProfilingResolution::PROF_US) << std::endl;
-		}
-
-		std::cout << "Cumulative Histogram Complete" << std::endl;
-		//  STEP 3 :: Normalise histogram
-		//		find max
-		queue.enqueueReadBuffer(dev_cumulative_histogram, CL_TRUE, 0, cumulative_histogram.size() * sizeof(int), &cumulative_histogram[0]);
-		int max = cumulative_histogram[cumulative_histogram.size() - 1];
-		for (int i = 0; i < image_input.spectrum(); i++)
-		{
-			int v = cumulative_histogram[(256 * (i + 1)) - 1];
-			if (v > max)
-				max = v;
-		}
-		//		devices
-		cl::Buffer dev_divideby(context, CL_MEM_READ_WRITE, sizeof(int));
-		cl::Buffer dev_normalised_histogram(context, CL_MEM_READ_WRITE, cumulative_histogram.size() * sizeof(int));
-		queue.enqueueWriteBuffer(dev_divideby, CL_TRUE, 0, sizeof(int), &max);
-		//		kernel
-		cl::Kernel normalise = cl::Kernel(program, "divide");
-		normalise.setArg(0, dev_cumulative_histogram);
-		normalise.setArg(1, dev_normalised_histogram);
-		normalise.setArg(2, dev_divideby);
-		queue.enqueueNDRangeKernel(normalise, cl::NullRange, cl::NDRange(cumulative_histogram.size()), cl::NullRange, NULL, &profile_event);
-		std::cout << "Normalised Histogram" << std::endl;
-		clFinish(queue.get());
-		std::cout << "Kernel execution time [ns]: " << profile_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - profile_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-		std::cout << GetFullProfilingInfo(profile_event, ProfilingResolution::PROF_US) << std::endl;
-
-		//  STEP 4 :: Back-projection using lut
-
-		cl::Kernel backprojection = cl::Kernel(program, "project");
-		backprojection.setArg(0, dev_image_input);
-		backprojection.setArg(1, dev_normalised_histogram);
-		backprojection.setArg(2, dev_image_output);
-		
-		queue.enqueueNDRangeKernel(backprojection, cl::NullRange, cl::NDRange(image_input.width(), image_input.height(), image_input.spectrum()), cl::NullRange, NULL, &profile_event);
-		std::cout << "Back-projection Complete" << std::endl;
-		clFinish(queue.get());
-		std::cout << "Kernel execution time [ns]: " << profile_event.getProfilingInfo<CL_PROFILING_COMMAND_END>() - profile_event.getProfilingInfo<CL_PROFILING_COMMAND_START>() << std::endl;
-		std::cout << GetFullProfilingInfo(profile_event, ProfilingResolution::PROF_US) << std::endl;
+		//each pipeline has its own program unit, compiled lazily the first time the pipeline is used
+		ProgramLibrary programs(context, cache_dir, kernel_dir);
+		programs.Register("equalisation", "equalise.cl");
+		programs.Register("filtering", "filters.cl");
+		programs.Register("reductions", "reductions.cl");
+		programs.Register("layout", "layout.cl");
+
+		//the equalisation unit is built in the background so that it overlaps with image decoding and buffer allocation
+		programs.Prefetch("equalisation");
+		if (layout == LAYOUT_DEVICE_CONVERT || (layout == LAYOUT_PLANAR && !output_filename.empty()))
+			programs.Prefetch("layout");
+
+		//OpenCL 2.x devices with SVM run the pipeline on shared virtual memory, everything else uses buffers
+		const DeviceInfo& device_info = DeviceRegistry::Get().Device(platform_id, device_id);
+#ifdef ENABLE_SVM
+		bool svm = allow_svm && SupportsCoarseGrainSvm(device_info);
+#else
+		bool svm = false;
+		(void)allow_svm;
+#endif
+		std::cout << "Shared virtual memory: " << (svm ? "on" : "off") << std::endl;
+
+		//host and device share memory on CPU and integrated devices, so images are used in place there
+		//elsewhere images are decoded into pinned staging memory so that transfers can be asynchronous
+		bool zero_copy = !svm && allow_zero_copy && device_info.host_unified_memory;
+		TransferMode transfer_mode = zero_copy ? TRANSFER_ZERO_COPY : (allow_pinned && !svm ? TRANSFER_PINNED : TRANSFER_PAGEABLE);
+		std::cout << "Zero-copy host buffers: " << (zero_copy ? "on" : "off") << ", pinned staging: " << (transfer_mode == TRANSFER_PINNED ? "on" : "off") << std::endl;
 
-		vector<unsigned char> output_buffer(image_input.size());
-		//4.3 Copy the result from device to host
-		queue.enqueueReadBuffer(dev_image_output, CL_TRUE, 0, output_buffer.size(), &output_buffer.data()[0]);
+		//staging memory is kept mapped and grown as needed across the images of a batch, on the -numa node where the runtime allows
+		StagingBuffer input_staging(host_policy), output_staging(host_policy);
+		//all other per-image host memory comes from the arena, which keeps its slabs across the batch
+		HostArena host_arena(1 << 20, host_policy);
+		if (!host_policy.IsDefault())
+			std::cout << "Host memory: NUMA node " << host_policy.numa_node << ", huge pages " << (host_policy.huge_pages ? "on" : "off") << std::endl;
 
-		CImg<unsigned char> output_image(output_buffer.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum());
-		CImgDisplay disp_output(output_image, "output");
+		//host memory for an image: pinned staging memory when transferring through it, otherwise
+		//page-aligned arena memory (which zero-copy buffers can also use in place)
+		auto image_memory = [&](StagingBuffer& staging, size_t size) -> unsigned char* {
+			if (transfer_mode == TRANSFER_PINNED) {
+				staging.Reserve(context, queue, size);
+				return staging.Data();
+			}
+			return (unsigned char*)host_arena.Allocate(size, HOST_PAGE_SIZE);
+		};
 
-		while (!disp_input.is_closed() && !disp_output.is_closed()
-			&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
-			disp_input.wait(1);
-			disp_output.wait(1);
+		//device buffers are recycled across the images of a batch
+		BufferPool pool(context, pool_cap_mb * 1024 * 1024);
+		pool.SetTracker(&tracker);
+
+		//kernels are finalised and buffers faulted in before the first image, which is then as fast as the rest
+		//the image buffers are only pooled on the copying paths, and sized from the first image's header when it has one
+		if (warm_up) {
+			startup_phase = std::chrono::steady_clock::now();
+			int width, height, spectrum;
+			bool pooled_images = transfer_mode != TRANSFER_ZERO_COPY && !svm;
+			size_t image_size = pooled_images && !image_filenames.empty() && ReadPnmSize(image_filenames[0], width, height, spectrum) ? (size_t)width * height * spectrum : 0;
+			std::cout << WarmUpPipeline(programs, queue, pool, tracker, image_size, layout, pass_alpha, !output_filename.empty());
+			programs.ForgetKernelArguments();
+			GetStartupProfile().Record("warm-up", ElapsedMs(startup_phase));
+		}
+
+		if (streaming) {
+			SetBinaryStdio();
+			IgnoreBrokenPipes();
+			FrameFormat stream_format = RawFrameFormat(raw_width, raw_height, raw_spectrum);
+			if (stream_y4m && !ReadY4mHeader(stdin, stream_format))
+				std::cerr << "ERROR: stdin is not an 8-bit 4:2:0, 4:2:2, 4:4:4 or mono Y4M stream" << std::endl;
+			else
+				std::cout << EqualiseStream(stdin, stdout, stream_format, programs, context, tracker);
+			programs.ForgetKernelArguments();
+		}
+
+		for (unsigned int volume_id = 0; volume_id < volume_filenames.size(); volume_id++) {
+			//image caches are streamed from their mapping in the layout they were written in (with their histogram),
+			//anything else is decoded by CImg into planar memory first
+			const string& file_name = volume_filenames[volume_id];
+			MappedImageCache mapped_cache;
+			CImg<unsigned char> volume;
+			bool cached = IsImageCache(file_name) && mapped_cache.Open(file_name);
+			if (cached)
+				volume.assign(mapped_cache.Pixels(), mapped_cache.Width(), mapped_cache.Height(), mapped_cache.Depth(), mapped_cache.Spectrum(), true);
+			else
+				volume.load(file_name.c_str());
+			if (volume.is_empty()) {
+				std::cerr << "ERROR: " << file_name << " has no voxels to equalise" << std::endl;
+				continue;
+			}
+			ImageCacheLayout volume_layout = cached ? mapped_cache.Layout() : IMAGE_CACHE_PLANAR;
+			const int32_t* cached_histogram = cached ? mapped_cache.Histogram() : nullptr;
+
+			std::cout << "Volume " << file_name << std::endl;
+			string output_name = output_filename.empty() ? "" : OutputFileName(output_filename, volume_id, volume_filenames.size());
+			std::cout << EqualiseVolume(volume.data(), volume.width(), volume.height(), volume.depth(), volume.spectrum(), volume_layout, output_name,
+				programs, context, pool, tracker, volume_slab_mb * 1024 * 1024, cached_histogram);
+			programs.ForgetKernelArguments();
+			std::cout << tracker.Report();
 		}
 
+		//a 3x3 convolution mask implementing an averaging filter
+		std::vector<float> convolution_mask = { 1.f / 9, 1.f / 9, 1.f / 9,
+												1.f / 9, 1.f / 9, 1.f / 9,
+												1.f / 9, 1.f / 9, 1.f / 9 };
+
+		//PNM inputs are read (and outputs written) many files at a time, ahead of and behind the pipeline
+		unique_ptr<BatchFileIO> batch_io;
+		if (use_batch_io && !image_filenames.empty()) {
+			batch_io.reset(new BatchFileIO());
+			batch_io->Prefetch(image_filenames);
+			std::cout << "Batch I/O: " << batch_io->Backend() << std::endl;
+		}
+
+		for (unsigned int image_id = 0; image_id < image_filenames.size(); image_id++) {
+			//the previous image (and anything displaying it) is done with its host memory
+			host_arena.Reset();
+
+			startup_phase = std::chrono::steady_clock::now();
+			CImg<unsigned char> image_input;
+			MappedPnm mapped_image;
+			MappedImageCache mapped_cache;
+			const int* cached_histogram = nullptr;
+			FileData file_data;
+			int width, height, spectrum;
+			bool loaded = false;
+			ImageCacheLayout host_layout = layout == LAYOUT_PLANAR ? IMAGE_CACHE_PLANAR : IMAGE_CACHE_INTERLEAVED;
+			//with batch I/O the file is only read once, by the batch, and told apart by its first bytes
+			bool batch_read = batch_io && batch_io->Read(image_id, file_data);
+			bool cached = batch_io ? batch_read && IsImageCache(file_data.data, file_data.size) && mapped_cache.Open(file_data.data, file_data.size) :
+				IsImageCache(image_filenames[image_id]) && mapped_cache.Open(image_filenames[image_id]);
+			if (cached) {
+				//image cache: the cached pixels are uploaded from in place when they are in the layout the kernels read,
+				//otherwise they are copied or converted into image memory. that includes staging memory and zero-copy mode,
+				//since a mapping is read-only and must not be wrapped as a CL_MEM_USE_HOST_PTR buffer
+				int pixel_count = mapped_cache.Width() * mapped_cache.Height() * mapped_cache.Depth();
+				unsigned char* pixels = (unsigned char*)mapped_cache.Pixels();
+				if (mapped_cache.Layout() != host_layout || transfer_mode != TRANSFER_PAGEABLE) {
+					pixels = image_memory(input_staging, mapped_cache.PixelBytes());
+					if (mapped_cache.Layout() == host_layout)
+						memcpy(pixels, mapped_cache.Pixels(), mapped_cache.PixelBytes());
+					else if (host_layout == IMAGE_CACHE_PLANAR)
+						DeinterleaveToPlanar(mapped_cache.Pixels(), pixels, pixel_count, mapped_cache.Spectrum());
+					else
+						InterleaveFromPlanar(mapped_cache.Pixels(), pixels, pixel_count, mapped_cache.Spectrum());
+				}
+				image_input.assign(pixels, mapped_cache.Width(), mapped_cache.Height(), mapped_cache.Depth(), mapped_cache.Spectrum(), true);
+				cached_histogram = (const int*)mapped_cache.Histogram();
+				loaded = true;
+			}
+			else if (batch_io ? batch_read && mapped_image.Open(file_data.data, file_data.size) : mapped_image.Open(image_filenames[image_id])) {
+				//8-bit PGM/PPM: converted from the mapped file straight into its final memory (a plain copy for binary files
+				//when interleaved), ascii files are parsed in parallel
+				image_input.assign(image_memory(input_staging, mapped_image.PixelBytes()), mapped_image.Width(), mapped_image.Height(), 1, mapped_image.Spectrum(), true);
+				loaded = layout != LAYOUT_PLANAR ? mapped_image.ReadInterleaved(image_input.data()) : mapped_image.ReadPlanar(image_input.data());
+				//malformed ascii files are left to CImg
+				if (!loaded)
+					image_input.assign();
+			}
+			if (!loaded && layout == LAYOUT_PLANAR && ReadPnmSize(image_filenames[image_id], width, height, spectrum)) {
+				//the size is known from the header, so the image is decoded straight into its final memory
+				image_input.assign(image_memory(input_staging, (size_t)width * height * spectrum), width, height, 1, spectrum, true);
+				image_input.load_pnm(image_filenames[image_id].c_str());
+			}
+			else if (!loaded) {
+				image_input.load(image_filenames[image_id].c_str());
+			}
+			if (image_id == 0)
+				GetStartupProfile().Record("image load", ElapsedMs(startup_phase));
+
+			if (benchmark_transfers && image_id == 0)
+				std::cout << TransferBenchmark(context, queue, image_input.size());
+			if (benchmark_host_memory && image_id == 0)
+				std::cout << HostMemoryBenchmark(image_input.size(), host_policy);
+
+			//both images are views of staging or arena memory (or of a mapped image cache)
+			if (!image_input.is_shared()) {
+				//other formats are decoded by CImg first and copied in
+				unsigned char* input_memory = image_memory(input_staging, image_input.size());
+				if (layout != LAYOUT_PLANAR)
+					InterleaveFromPlanar(image_input.data(), input_memory, (size_t)image_input.width() * image_input.height() * image_input.depth(), image_input.spectrum());
+				else
+					memcpy(input_memory, image_input.data(), image_input.size());
+				image_input.assign(input_memory, image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum(), true);
+			}
+			if (!cache_output_filename.empty()) {
+				string file_name = OutputFileName(cache_output_filename, image_id, image_filenames.size());
+				if (!WriteImageCache(file_name, image_input.data(), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum(), host_layout))
+					std::cerr << "Could not write " << file_name << std::endl;
+			}
+			//outside -vol the slices of a stack (e.g. a cache written from a volume) are equalised as one image of them one
+			//below the other, with one histogram over all of them as a cached one counts; the 2D kernels and the output file
+			//only see width x height pixels per channel plane
+			if (image_input.depth() > 1) {
+				std::cout << "Image " << image_filenames[image_id] << " has " << image_input.depth() << " slices, equalised as one "
+					<< image_input.width() << "x" << image_input.height() * image_input.depth() << " image (-vol equalises it as a volume)" << std::endl;
+				image_input.assign(image_input.data(), image_input.width(), image_input.height() * image_input.depth(), 1, image_input.spectrum(), true);
+			}
+			CImg<unsigned char> output_image(image_memory(output_staging, image_input.size()), image_input.width(), image_input.height(), image_input.depth(), image_input.spectrum(), true);
+
+			std::cout << "Image " << image_filenames[image_id] << std::endl;
+			//only images that end in an alpha channel have one to pass through
+			bool image_pass_alpha = pass_alpha && (image_input.spectrum() == 2 || image_input.spectrum() == 4);
+
+			//the pipeline hands the result over interleaved, from the memory it was downloaded to or from the mapped
+			//device-interleaved output of a planar run, and it is written from there without another copy
+			function<void(const unsigned char*)> write_output;
+			if (!output_filename.empty()) {
+				string file_name = OutputFileName(output_filename, image_id, image_filenames.size());
+				write_output = [&, file_name](const unsigned char* output_pixels) {
+					auto write_start = std::chrono::steady_clock::now();
+					string header = PnmHeaderText(output_image.width(), output_image.height() * output_image.depth(), output_image.spectrum());
+					if (batch_io && !header.empty())
+						batch_io->Write(file_name, header, output_pixels, output_image.size());
+					else if (WritePnm(file_name, output_pixels, output_image.width(), output_image.height() * output_image.depth(), output_image.spectrum(), output_chunks))
+						std::cout << "Output " << file_name << " written [MB/s]: " << TransferRate(output_image.size(), ElapsedMs(write_start)) << std::endl;
+					else
+						std::cerr << "Could not write " << file_name << " (8-bit grey or RGB images only)" << std::endl;
+				};
+			}
+#ifdef ENABLE_SVM
+			if (svm)
+				EqualiseImageSvm(image_input, output_image, programs, queue, layout, image_pass_alpha, cached_histogram, write_output);
+			else
+#endif
+			EqualiseImage(image_input, output_image, programs, queue, pool, host_arena, tracker, transfer_mode, layout, image_pass_alpha, cached_histogram, write_output);
+			//the image's buffers are back in the pool (where they may be evicted) or released, so their handles can be
+			//recycled for the next image's buffers
+			programs.ForgetKernelArguments();
+
+			if (display) {
+				CImgDisplay disp_input(PlanarImage(image_input, layout), "input");
+				CImgDisplay disp_output(PlanarImage(output_image, layout), "output");
+
+				while (!disp_input.is_closed() && !disp_output.is_closed()
+					&& !disp_input.is_keyESC() && !disp_output.is_keyESC()) {
+					disp_input.wait(1);
+					disp_output.wait(1);
+				}
+			}
+		}
+
+		std::cout << programs.Report();
+		std::cout << GetStartupProfile().Report();
+		std::cout << pool.Report();
+		std::cout << host_arena.Report();
+		if (batch_io) {
+			if (!batch_io->Flush())
+				std::cerr << "Some output files could not be written" << std::endl;
+			std::cout << batch_io->Report();
+		}
 	}
 	catch (const cl::Error& err) {
 		std::cerr << "ERROR: " << err.what() << ", " << getErrorString(err.err()) << std::endl;
@@ -178,5 +1269,6 @@ int main(int argc, char** argv) {
 		std::cerr << "ERROR: " << err.what() << std::endl;
 	}
 
+	std::cout.rdbuf(cout_buffer);
 	return 0;
 }
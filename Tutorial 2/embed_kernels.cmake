@@ -0,0 +1,42 @@
+# Embeds every OpenCL kernel file in KERNEL_DIR into a C++ header as raw string literals,
+# the CMake counterpart of embed_kernels.ps1 for builds outside Visual Studio.
+# Usage: cmake -DKERNEL_DIR=<kernels directory> -DOUTPUT=<header> -P embed_kernels.cmake
+
+if(NOT KERNEL_DIR OR NOT OUTPUT)
+	message(FATAL_ERROR "usage: cmake -DKERNEL_DIR=<dir> -DOUTPUT=<file> -P embed_kernels.cmake")
+endif()
+
+# the same piece size as embed_kernels.ps1, which stays below MSVC's string literal limit
+set(chunk_size 8000)
+
+set(header "//generated by embed_kernels.cmake from the kernels directory, do not edit\n")
+string(APPEND header "#pragma once\n\nconst EmbeddedKernelSource embedded_kernel_sources[] = {\n")
+
+file(GLOB kernel_files "${KERNEL_DIR}/*.cl")
+list(SORT kernel_files)
+foreach(kernel_file IN LISTS kernel_files)
+	get_filename_component(name "${kernel_file}" NAME)
+	file(READ "${kernel_file}" source)
+	string(LENGTH "${source}" length)
+	string(APPEND header "\t{ \"${name}\",\n")
+	if(length EQUAL 0)
+		string(APPEND header "\t\t\"\"\n")
+	else()
+		math(EXPR last "${length} - 1")
+		foreach(offset RANGE 0 ${last} ${chunk_size})
+			string(SUBSTRING "${source}" ${offset} ${chunk_size} piece)
+			string(APPEND header "\t\tR\"__cl__(${piece})__cl__\"\n")
+		endforeach()
+	endif()
+	string(APPEND header "\t},\n")
+endforeach()
+string(APPEND header "};\n")
+
+# only touch the header when the contents change, so unchanged kernels do not trigger a recompile
+if(EXISTS "${OUTPUT}")
+	file(READ "${OUTPUT}" previous)
+	if(previous STREQUAL header)
+		return()
+	endif()
+endif()
+file(WRITE "${OUTPUT}" "${header}")
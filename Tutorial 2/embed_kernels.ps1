@@ -0,0 +1,43 @@
+# Embeds every OpenCL kernel file in KernelDir into a C++ header as raw string literals,
+# so that the executable does not need the .cl files at runtime.
+# Called by the custom build step in Tutorial 2.vcxproj whenever a kernel file changes.
+param(
+	[Parameter(Mandatory = $true)][string]$KernelDir,
+	[Parameter(Mandatory = $true)][string]$Output
+)
+
+$ErrorActionPreference = "Stop"
+
+# MSVC limits a single string literal to 16380 bytes (65535 after concatenation),
+# so longer sources are emitted as several adjacent pieces
+$chunk_size = 8000
+
+$header = New-Object System.Text.StringBuilder
+[void]$header.AppendLine("//generated by embed_kernels.ps1 from the kernels directory, do not edit")
+[void]$header.AppendLine("#pragma once")
+[void]$header.AppendLine("")
+[void]$header.AppendLine("const EmbeddedKernelSource embedded_kernel_sources[] = {")
+
+foreach ($file in Get-ChildItem -Path $KernelDir -Filter *.cl | Sort-Object Name) {
+	$source = [System.IO.File]::ReadAllText($file.FullName)
+	[void]$header.AppendLine("`t{ `"$($file.Name)`",")
+	if ($source.Length -eq 0) {
+		[void]$header.AppendLine("`t`t`"`"")
+	}
+	for ($i = 0; $i -lt $source.Length; $i += $chunk_size) {
+		$piece = $source.Substring($i, [Math]::Min($chunk_size, $source.Length - $i))
+		[void]$header.AppendLine("`t`tR`"__cl__(" + $piece + ")__cl__`"")
+	}
+	[void]$header.AppendLine("`t},")
+}
+
+[void]$header.AppendLine("};")
+
+# only touch the header when the contents change, so unchanged kernels do not trigger a recompile
+$text = $header.ToString()
+if ((Test-Path $Output) -and ([System.IO.File]::ReadAllText($Output) -eq $text)) {
+	exit 0
+}
+
+New-Item -ItemType Directory -Force -Path (Split-Path -Parent $Output) | Out-Null
+[System.IO.File]::WriteAllText($Output, $text)
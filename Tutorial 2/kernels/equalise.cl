@@ -0,0 +1,187 @@
+//histogram equalisation pipeline: histogram -> cumulative histogram -> normalised lut -> back-projection
+
+kernel void histogram255(global const uchar* A, global int* C) {
+	int width = get_global_size(0); //image width in pixels
+	int height = get_global_size(1); //image height in pixels
+	int image_size = width*height; //image size in pixels
+	int channels = get_global_size(2); //number of colour channels: 3 for RGB
+
+	int x = get_global_id(0); //current x coord.
+	int y = get_global_id(1); //current y coord.
+	int c = get_global_id(2); //current colour channel
+
+	int id = x + y*width + c*image_size; //global id in 1D space
+
+	int v = A[id];
+	if (v > 255) {
+		v = 255;
+	}
+	// set the histogram intensity for channel, atomically since many pixels share a bin
+	atomic_inc(&C[(c * 256) + v]);
+}
+
+// FUNCTION FROM WORKSHOP CODE
+//a double-buffered version of the Hillis-Steele inclusive scan
+//requires two additional input arguments which correspond to two local buffers
+kernel void scan_add(__global const int* A, global int* B, local int* scratch_1, local int* scratch_2) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	local int *scratch_3;//used for buffer swap
+
+	//cache all N values from global memory to local memory
+	scratch_1[lid] = A[id];
+
+	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
+
+	for (int i = 1; i < N; i *= 2) {
+		if (lid >= i)
+			scratch_2[lid] = scratch_1[lid] + scratch_1[lid - i];
+		else
+			scratch_2[lid] = scratch_1[lid];
+
+		barrier(CLK_LOCAL_MEM_FENCE);
+
+		//buffer swap
+		scratch_3 = scratch_2;
+		scratch_2 = scratch_1;
+		scratch_1 = scratch_3;
+	}
+
+	//copy the cache to output array
+	B[id] = scratch_1[lid];
+}
+
+kernel void divide(global const int* A, global int* B, global int* C) {
+	int id = get_global_id(0);
+	int c = *C;
+	B[id] = (A[id] * 255) / c;
+	//B[id] = C
+}
+
+kernel void project(global const uchar* A, global const int* B, global uchar* C) {
+	// A is input image
+	// B is lut
+	// C is new intensity value
+	int width = get_global_size(0); //image width in pixels
+	int height = get_global_size(1); //image height in pixels
+	int image_size = width*height; //image size in pixels
+	int channels = get_global_size(2); //number of colour channels: 3 for RGB
+
+	int x = get_global_id(0); //current x coord.
+	int y = get_global_id(1); //current y coord.
+	int c = get_global_id(2); //current colour channel
+
+	int id = x + y*width + c*image_size; //global id in 1D space
+	
+	int nid = (c * 256) + A[id];
+	C[id] = B[nid];
+}
+
+//interleaved-layout variants, for pixels packed as in PPM files (RGBRGB... or RGBARGBA...)
+//the histograms come out in the same planar bins (c*256 + v) as histogram255, so scan_add and divide are shared
+
+//all channel histograms in one pass, one work item per pixel
+//each work group counts into a local histogram H (channels*256 ints) and merges it into C once,
+//so global atomics are per bin and group instead of per pixel. the global size may be rounded up past pixel_count.
+kernel void histogram_interleaved(global const uchar* A, global int* C, int pixel_count, int channels, local int* H) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int bins = channels * 256;
+
+	for (int i = lid; i < bins; i += N)
+		H[i] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < pixel_count) {
+		if (channels == 3) {
+			uchar3 p = vload3(id, A);
+			atomic_inc(&H[p.x]);
+			atomic_inc(&H[256 + p.y]);
+			atomic_inc(&H[512 + p.z]);
+		}
+		else if (channels == 4) {
+			uchar4 p = vload4(id, A);
+			atomic_inc(&H[p.x]);
+			atomic_inc(&H[256 + p.y]);
+			atomic_inc(&H[512 + p.z]);
+			atomic_inc(&H[768 + p.w]);
+		}
+		else {
+			for (int c = 0; c < channels; c++)
+				atomic_inc(&H[(c * 256) + A[id * channels + c]]);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < bins; i += N) {
+		if (H[i] != 0)
+			atomic_add(&C[i], H[i]);
+	}
+}
+
+//back-projection of an interleaved image through the per-channel lut B, one work item per pixel
+kernel void project_interleaved(global const uchar* A, global const int* B, global uchar* C, int channels) {
+	int id = get_global_id(0);
+
+	if (channels == 3) {
+		uchar3 p = vload3(id, A);
+		vstore3(convert_uchar3((int3)(B[p.x], B[256 + p.y], B[512 + p.z])), id, C);
+	}
+	else if (channels == 4) {
+		uchar4 p = vload4(id, A);
+		vstore4(convert_uchar4((int4)(B[p.x], B[256 + p.y], B[512 + p.z], B[768 + p.w])), id, C);
+	}
+	else {
+		for (int c = 0; c < channels; c++)
+			C[id * channels + c] = B[(c * 256) + A[id * channels + c]];
+	}
+}
+
+//interleaved images whose last channel is alpha (RGBA or grey + alpha): alpha is neither counted nor equalised but
+//copied through, so the histogram has (channels - 1) * 256 bins. channels must be 4 or 2: pixels are accessed as whole
+//uchar4 or uchar2 values, which are naturally aligned in the buffer.
+
+kernel void histogram_alpha(global const uchar* A, global int* C, int pixel_count, int channels, local int* H) {
+	int id = get_global_id(0);
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int bins = (channels - 1) * 256;
+
+	for (int i = lid; i < bins; i += N)
+		H[i] = 0;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (id < pixel_count) {
+		if (channels == 4) {
+			uchar4 p = ((global const uchar4*)A)[id];
+			atomic_inc(&H[p.x]);
+			atomic_inc(&H[256 + p.y]);
+			atomic_inc(&H[512 + p.z]);
+		}
+		else {
+			uchar2 p = ((global const uchar2*)A)[id];
+			atomic_inc(&H[p.x]);
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (int i = lid; i < bins; i += N) {
+		if (H[i] != 0)
+			atomic_add(&C[i], H[i]);
+	}
+}
+
+kernel void project_alpha(global const uchar* A, global const int* B, global uchar* C, int channels) {
+	int id = get_global_id(0);
+
+	if (channels == 4) {
+		uchar4 p = ((global const uchar4*)A)[id];
+		((global uchar4*)C)[id] = (uchar4)(convert_uchar3((int3)(B[p.x], B[256 + p.y], B[512 + p.z])), p.w);
+	}
+	else {
+		uchar2 p = ((global const uchar2*)A)[id];
+		((global uchar2*)C)[id] = (uchar2)((uchar)B[p.x], p.y);
+	}
+}
@@ -1,3 +1,5 @@
+//per-pixel and neighbourhood image filters
+
 //a simple OpenCL kernel which copies all pixels from A to B
 kernel void identity(global const uchar* A, global uchar* B) {
 	int id = get_global_id(0);
@@ -109,103 +111,3 @@ kernel void convolutionND(global const uchar* A, global uchar* B, constant float
 
 	B[id] = (uchar)result;
 }
-
-kernel void histogram255(global const uchar* A, global int* C) {
-	int width = get_global_size(0); //image width in pixels
-	int height = get_global_size(1); //image height in pixels
-	int image_size = width*height; //image size in pixels
-	int channels = get_global_size(2); //number of colour channels: 3 for RGB
-
-	int x = get_global_id(0); //current x coord.
-	int y = get_global_id(1); //current y coord.
-	int c = get_global_id(2); //current colour channel
-
-	int id = x + y*width + c*image_size; //global id in 1D space
-
-	int v = A[id];
-	if (v > 255) {
-		v = 255;
-	}
-	// set the histogram intensity for channel
-	C[(c * 256) + v]++;
-}
-
-//flexible step reduce 
-// FUNCTION FROM WORKSHOP CODE BUT MODIFIED
-kernel void reduce_max(global const int* A, global int* B) {
-	int id = get_global_id(0);
-	int N = get_global_size(0);
-
-	B[id] = A[id];
-
-	barrier(CLK_GLOBAL_MEM_FENCE);
-
-	for (int i = 1; i < N; i *= 2) { //i is a stride
-		if (!(id % (i * 2)) && ((id + i) < N)) {
-			if (B[id] < B[id + i]) {
-				B[id] = B[id + i];
-			}
-		}
-
-		barrier(CLK_GLOBAL_MEM_FENCE);
-	}
-}
-
-kernel void project(global const uchar* A, global const int* B, global uchar* C) {
-	// A is input image
-	// B is lut
-	// C is new intensity value
-	int width = get_global_size(0); //image width in pixels
-	int height = get_global_size(1); //image height in pixels
-	int image_size = width*height; //image size in pixels
-	int channels = get_global_size(2); //number of colour channels: 3 for RGB
-
-	int x = get_global_id(0); //current x coord.
-	int y = get_global_id(1); //current y coord.
-	int c = get_global_id(2); //current colour channel
-
-	int id = x + y*width + c*image_size; //global id in 1D space
-	
-	int nid = (c * 256) - 1 + A[id];
-	C[id] = B[nid];
-}
-
-kernel void divide(global const int* A, global int* B, global int* C) {
-	int id = get_global_id(0);
-	int c = *C;
-	B[id] = (A[id] * 255) / c;
-	//B[id] = C
-}
-
-
-// FUNCTION FROM WORKSHOP CODE
-//a double-buffered version of the Hillis-Steele inclusive scan
-//requires two additional input arguments which correspond to two local buffers
-kernel void scan_add(__global const int* A, global int* B, local int* scratch_1, local int* scratch_2) {
-	int id = get_global_id(0);
-	int lid = get_local_id(0);
-	int N = get_local_size(0);
-	local int *scratch_3;//used for buffer swap
-
-	//cache all N values from global memory to local memory
-	scratch_1[lid] = A[id];
-
-	barrier(CLK_LOCAL_MEM_FENCE);//wait for all local threads to finish copying from global to local memory
-
-	for (int i = 1; i < N; i *= 2) {
-		if (lid >= i)
-			scratch_2[lid] = scratch_1[lid] + scratch_1[lid - i];
-		else
-			scratch_2[lid] = scratch_1[lid];
-
-		barrier(CLK_LOCAL_MEM_FENCE);
-
-		//buffer swap
-		scratch_3 = scratch_2;
-		scratch_2 = scratch_1;
-		scratch_1 = scratch_3;
-	}
-
-	//copy the cache to output array
-	B[id] = scratch_1[lid];
-}
@@ -0,0 +1,51 @@
+//conversion between interleaved (RGBRGB... as in PPM files) and planar (RR..GG..BB.. as in CImg) images
+//an image is a pixel_count x channels matrix, so both directions are a transpose. each work group moves a tile of
+//get_local_size(0) pixels through local memory T (local size * channels bytes): the interleaved side is read or
+//written as one contiguous run of bytes, the planar side as one contiguous run per channel, so neither is strided.
+//the global size may be rounded up past pixel_count.
+
+//interleaved A to planar B
+kernel void deinterleave(global const uchar* A, global uchar* B, int pixel_count, int channels, local uchar* T) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int first = get_group_id(0) * N; //first pixel of the tile
+	int id = first + lid;
+
+	//consecutive work items read consecutive bytes of the tile
+	int tile_bytes = N * channels;
+	int offset = first * channels;
+	int total_bytes = pixel_count * channels;
+	for (int i = lid; i < tile_bytes; i += N) {
+		if (offset + i < total_bytes)
+			T[i] = A[offset + i];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	//and consecutive pixels of each channel plane
+	if (id < pixel_count) {
+		for (int c = 0; c < channels; c++)
+			B[(c * pixel_count) + id] = T[(lid * channels) + c];
+	}
+}
+
+//planar A to interleaved B, the inverse of deinterleave
+kernel void interleave(global const uchar* A, global uchar* B, int pixel_count, int channels, local uchar* T) {
+	int lid = get_local_id(0);
+	int N = get_local_size(0);
+	int first = get_group_id(0) * N;
+	int id = first + lid;
+
+	if (id < pixel_count) {
+		for (int c = 0; c < channels; c++)
+			T[(lid * channels) + c] = A[(c * pixel_count) + id];
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	int tile_bytes = N * channels;
+	int offset = first * channels;
+	int total_bytes = pixel_count * channels;
+	for (int i = lid; i < tile_bytes; i += N) {
+		if (offset + i < total_bytes)
+			B[offset + i] = T[i];
+	}
+}
@@ -0,0 +1,505 @@
+#pragma once
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__) && defined(USE_IO_URING)
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <liburing.h>
+#define HAVE_IO_URING
+#endif
+
+#include "Utils.h"
+#include "HostMemory.h"
+#include "StagingBuffer.h"
+
+//batch file I/O: the files of a batch are read ahead of the pipeline and its results written behind it, many at a time
+//Linux builds with USE_IO_URING (linked against liburing) queue the opens, reads, writes and closes to the kernel through
+//an io_uring, with up to depth reads and depth writes in flight into buffers registered with the ring once; elsewhere,
+//or where the kernel refuses to set up a ring, a fixed set of depth worker threads reads and writes the same window of files.
+
+//a file read by BatchFileIO
+struct FileData {
+	const unsigned char* data = nullptr;
+	size_t size = 0;
+};
+
+//whole-file reads and writes for the worker thread path
+struct FileContents {
+	bool ok = false;
+	vector<unsigned char> bytes;
+};
+
+FileContents ReadWholeFile(const string& file_name) {
+	FileContents contents;
+	ifstream file(file_name, ios::binary | ios::ate);
+	if (!file)
+		return contents;
+	contents.bytes.resize((size_t)file.tellg());
+	file.seekg(0);
+	file.read((char*)contents.bytes.data(), contents.bytes.size());
+	contents.ok = (bool)file;
+	return contents;
+}
+
+bool WriteWholeFile(const string& file_name, const vector<unsigned char>& bytes) {
+	ofstream file(file_name, ios::binary | ios::trunc);
+	file.write((const char*)bytes.data(), bytes.size());
+	return (bool)file;
+}
+
+//a fixed set of threads running queued tasks in order, so a batch does not start a thread per file
+//tasks queued before destruction still run, the destructor waits for them
+class IoWorkers {
+public:
+	explicit IoWorkers(size_t count) : stopping(false) {
+		for (size_t i = 0; i < max((size_t)1, count); i++)
+			threads.emplace_back(&IoWorkers::Work, this);
+	}
+
+	IoWorkers(const IoWorkers&) = delete;
+	IoWorkers& operator=(const IoWorkers&) = delete;
+
+	~IoWorkers() {
+		{
+			lock_guard<mutex> lock(tasks_mutex);
+			stopping = true;
+		}
+		tasks_ready.notify_all();
+		for (auto& worker : threads)
+			worker.join();
+	}
+
+	template <typename T>
+	future<T> Run(function<T()> task) {
+		auto packaged = make_shared<packaged_task<T()>>(move(task));
+		future<T> result = packaged->get_future();
+		{
+			lock_guard<mutex> lock(tasks_mutex);
+			tasks.push_back([packaged]() { (*packaged)(); });
+		}
+		tasks_ready.notify_one();
+		return result;
+	}
+
+private:
+	void Work() {
+		for (;;) {
+			function<void()> task;
+			{
+				unique_lock<mutex> lock(tasks_mutex);
+				tasks_ready.wait(lock, [this]() { return stopping || !tasks.empty(); });
+				if (tasks.empty())
+					return;
+				task = move(tasks.front());
+				tasks.pop_front();
+			}
+			task();
+		}
+	}
+
+	vector<thread> threads;
+	deque<function<void()>> tasks;
+	mutex tasks_mutex;
+	condition_variable tasks_ready;
+	bool stopping;
+};
+
+class BatchFileIO {
+public:
+	//files of up to buffer_size bytes go through the registered buffers, larger ones through their own allocation
+	explicit BatchFileIO(unsigned int depth = 16, size_t buffer_size = 1 << 20)
+		: depth(max(1u, depth)), buffer_size(buffer_size), next_read(0), next_result(0),
+		files_read(0), bytes_read(0), files_written(0), bytes_written(0), write_failed(false) {
+		start = chrono::steady_clock::now();
+#ifdef HAVE_IO_URING
+		uring = false;
+		registered = false;
+		buffers = nullptr;
+		//depth + 1 read slots (the file handed out plus depth in flight) and depth write slots, at most one request each
+		slots.resize(2 * this->depth + 1);
+		if (io_uring_queue_init((unsigned int)slots.size() + 1, &ring, 0) == 0) {
+			uring = true;
+			buffers = (unsigned char*)AlignedAlloc(slots.size() * buffer_size);
+			vector<iovec> iovecs(slots.size());
+			for (size_t i = 0; i < slots.size(); i++) {
+				iovecs[i].iov_base = buffers + i * buffer_size;
+				iovecs[i].iov_len = buffer_size;
+			}
+			//registering pins the buffers and can fail against RLIMIT_MEMLOCK, plain reads and writes into them still work
+			registered = io_uring_register_buffers(&ring, iovecs.data(), (unsigned int)iovecs.size()) == 0;
+		}
+		if (!uring)
+#endif
+			workers.reset(new IoWorkers(this->depth));
+	}
+
+	BatchFileIO(const BatchFileIO&) = delete;
+	BatchFileIO& operator=(const BatchFileIO&) = delete;
+
+	~BatchFileIO() {
+		Flush();
+#ifdef HAVE_IO_URING
+		if (uring) {
+			//the kernel may still be reading into the buffers, or closing their files
+			for (size_t i = 0; i <= depth; i++)
+				while (slots[i].state == SLOT_OPEN || slots[i].state == SLOT_TRANSFER || slots[i].state == SLOT_CLOSE)
+					WaitCompletion();
+			io_uring_queue_exit(&ring);
+		}
+		if (buffers)
+			AlignedFree(buffers);
+#endif
+	}
+
+	const char* Backend() const {
+#ifdef HAVE_IO_URING
+		if (uring)
+			return registered ? "io_uring, registered buffers" : "io_uring";
+#endif
+		return "worker threads";
+	}
+
+	//starts reading file_names in order, keeping up to depth reads in flight ahead of Read()
+	void Prefetch(const vector<string>& file_names) {
+		read_names = file_names;
+		next_read = next_result = 0;
+		start = chrono::steady_clock::now();
+		SubmitReads();
+	}
+
+	//waits for file index of the prefetched list, which stays valid until the next call; indices must not decrease,
+	//files that are skipped over are waited for and dropped. false if the file could not be read.
+	bool Read(size_t index, FileData& file) {
+		if (index >= read_names.size() || index < next_result)
+			return false;
+
+		bool ok = false;
+		for (; next_result <= index; next_result++) {
+			//the slot of the file handed out before is free again, and skipped files must be in flight too
+			SubmitReads();
+#ifdef HAVE_IO_URING
+			if (uring) {
+				IoSlot& slot = slots[next_result % (depth + 1)];
+				while (slot.state != SLOT_DONE)
+					WaitCompletion();
+				ok = slot.ok;
+				file.data = slot.buffer;
+				file.size = slot.size;
+				continue;
+			}
+#endif
+			current = pending_reads.front().get();
+			pending_reads.pop_front();
+			ok = current.ok;
+			file.data = current.bytes.data();
+			file.size = current.bytes.size();
+			if (ok) {
+				files_read++;
+				bytes_read += current.bytes.size();
+			}
+		}
+		SubmitReads();
+		return ok;
+	}
+
+	//queues header and data to be written as file_name; both are copied, so the caller can reuse its memory at once
+	//only blocks while depth writes are already in flight
+	void Write(const string& file_name, const string& header, const unsigned char* data, size_t size) {
+#ifdef HAVE_IO_URING
+		if (uring) {
+			size_t id = depth + 1;
+			for (;;) {
+				while (id < slots.size() && slots[id].state != SLOT_IDLE)
+					id++;
+				if (id < slots.size())
+					break;
+				WaitCompletion();
+				id = depth + 1;
+			}
+			IoSlot& slot = slots[id];
+			slot.write = true;
+			slot.file_name = file_name;
+			slot.size = header.size() + size;
+			SelectBuffer(id);
+			memcpy(slot.buffer, header.data(), header.size());
+			memcpy(slot.buffer + header.size(), data, size);
+			slot.state = SLOT_OPEN;
+			io_uring_sqe* sqe = GetSqe();
+			io_uring_prep_openat(sqe, AT_FDCWD, slot.file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			io_uring_sqe_set_data(sqe, (void*)(uintptr_t)id);
+			io_uring_submit(&ring);
+			return;
+		}
+#endif
+		if (pending_writes.size() >= depth)
+			FinishWrite();
+		vector<unsigned char> bytes(header.begin(), header.end());
+		bytes.insert(bytes.end(), data, data + size);
+		size_t total = bytes.size();
+		auto shared_bytes = make_shared<vector<unsigned char>>(move(bytes));
+		pending_writes.push_back(make_pair(workers->Run<bool>([file_name, shared_bytes]() { return WriteWholeFile(file_name, *shared_bytes); }), total));
+	}
+
+	//waits for every queued write, false if any of them failed
+	bool Flush() {
+#ifdef HAVE_IO_URING
+		if (uring) {
+			for (size_t i = depth + 1; i < slots.size(); i++)
+				while (slots[i].state != SLOT_IDLE)
+					WaitCompletion();
+			return !write_failed;
+		}
+#endif
+		while (!pending_writes.empty())
+			FinishWrite();
+		return !write_failed;
+	}
+
+	string Report() const {
+		double ms = ElapsedMs(start);
+		stringstream sstream;
+		sstream << "Batch I/O (" << Backend() << ", depth " << depth << "): " << files_read << " files read (" << bytes_read << " B), "
+			<< files_written << " files written (" << bytes_written << " B), " << TransferRate(bytes_read + bytes_written, ms) << " MB/s"
+			<< (write_failed ? ", some writes failed" : "") << endl;
+		return sstream.str();
+	}
+
+private:
+	//tops the reads in flight up to depth files past the one handed out last
+	void SubmitReads() {
+		while (next_read < read_names.size() && next_read < next_result + depth) {
+#ifdef HAVE_IO_URING
+			if (uring) {
+				size_t id = next_read % (depth + 1);
+				IoSlot& slot = slots[id];
+				slot.write = false;
+				slot.size = 0;
+				slot.state = SLOT_OPEN;
+				io_uring_sqe* sqe = GetSqe();
+				io_uring_prep_openat(sqe, AT_FDCWD, read_names[next_read].c_str(), O_RDONLY, 0);
+				io_uring_sqe_set_data(sqe, (void*)(uintptr_t)id);
+				next_read++;
+				continue;
+			}
+#endif
+			string file_name = read_names[next_read];
+			pending_reads.push_back(workers->Run<FileContents>([file_name]() { return ReadWholeFile(file_name); }));
+			next_read++;
+		}
+#ifdef HAVE_IO_URING
+		if (uring)
+			io_uring_submit(&ring);
+#endif
+	}
+
+	void FinishWrite() {
+		if (pending_writes.front().first.get()) {
+			files_written++;
+			bytes_written += pending_writes.front().second;
+		}
+		else {
+			write_failed = true;
+		}
+		pending_writes.pop_front();
+	}
+
+	//tracks the worker thread path
+	deque<future<FileContents>> pending_reads;
+	FileContents current;
+	deque<pair<future<bool>, size_t>> pending_writes;
+	unique_ptr<IoWorkers> workers; //declared after the futures, so the reads still running finish before they go
+
+#ifdef HAVE_IO_URING
+	enum SlotState {
+		SLOT_IDLE,
+		SLOT_OPEN, //openat queued
+		SLOT_TRANSFER, //read or write queued, repeated for short transfers
+		SLOT_CLOSE, //close queued, the result is kept in ok meanwhile
+		SLOT_DONE //read complete (or failed), until the slot is reused
+	};
+
+	struct IoSlot {
+		SlotState state = SLOT_IDLE;
+		bool write = false;
+		int fd = -1;
+		unsigned char* buffer = nullptr; //the slot's registered buffer, or heap for larger files
+		vector<unsigned char> heap;
+		size_t size = 0;
+		size_t done = 0;
+		bool ok = false;
+		string file_name; //must stay valid until the kernel has read it
+	};
+
+	io_uring_sqe* GetSqe() {
+		io_uring_sqe* sqe = io_uring_get_sqe(&ring);
+		if (!sqe) {
+			io_uring_submit(&ring);
+			sqe = io_uring_get_sqe(&ring);
+		}
+		return sqe;
+	}
+
+	void SelectBuffer(size_t id) {
+		IoSlot& slot = slots[id];
+		if (slot.size <= buffer_size) {
+			slot.heap.clear();
+			slot.buffer = buffers + id * buffer_size;
+		}
+		else {
+			slot.heap.resize(slot.size);
+			slot.buffer = slot.heap.data();
+		}
+	}
+
+	void SubmitTransfer(size_t id) {
+		IoSlot& slot = slots[id];
+		unsigned int count = (unsigned int)min(slot.size - slot.done, (size_t)1 << 30);
+		bool fixed = registered && slot.buffer == buffers + id * buffer_size;
+		io_uring_sqe* sqe = GetSqe();
+		if (slot.write && fixed)
+			io_uring_prep_write_fixed(sqe, slot.fd, slot.buffer + slot.done, count, slot.done, (int)id);
+		else if (slot.write)
+			io_uring_prep_write(sqe, slot.fd, slot.buffer + slot.done, count, slot.done);
+		else if (fixed)
+			io_uring_prep_read_fixed(sqe, slot.fd, slot.buffer + slot.done, count, slot.done, (int)id);
+		else
+			io_uring_prep_read(sqe, slot.fd, slot.buffer + slot.done, count, slot.done);
+		io_uring_sqe_set_data(sqe, (void*)(uintptr_t)id);
+	}
+
+	//queues the close of the slot's file, if it was opened, and completes the slot once it is closed
+	void Finish(size_t id, bool ok) {
+		IoSlot& slot = slots[id];
+		slot.ok = ok;
+		if (slot.fd < 0)
+			return Complete(id);
+		slot.state = SLOT_CLOSE;
+		io_uring_sqe* sqe = GetSqe();
+		io_uring_prep_close(sqe, slot.fd);
+		io_uring_sqe_set_data(sqe, (void*)(uintptr_t)id);
+		slot.fd = -1;
+	}
+
+	void Complete(size_t id) {
+		IoSlot& slot = slots[id];
+		bool ok = slot.ok;
+		if (slot.write) {
+			if (ok) {
+				files_written++;
+				bytes_written += slot.size;
+			}
+			else {
+				write_failed = true;
+			}
+			slot.state = SLOT_IDLE;
+		}
+		else {
+			if (ok) {
+				files_read++;
+				bytes_read += slot.size;
+			}
+			slot.state = SLOT_DONE;
+		}
+	}
+
+	//advances the slot a completion belongs to: open -> (size the read buffer) -> transfer until complete
+	void HandleCompletion(const io_uring_cqe* cqe) {
+		size_t id = (size_t)(uintptr_t)io_uring_cqe_get_data(cqe);
+		IoSlot& slot = slots[id];
+		int result = cqe->res;
+		if (slot.state == SLOT_CLOSE) {
+			//a failed close can lose written data (e.g. on network file systems), a read is complete by then
+			if (result < 0 && slot.write)
+				slot.ok = false;
+			return Complete(id);
+		}
+		if (result < 0)
+			return Finish(id, false);
+
+		if (slot.state == SLOT_OPEN) {
+			slot.fd = result;
+			if (!slot.write) {
+				struct stat file_stat;
+				if (fstat(slot.fd, &file_stat) != 0)
+					return Finish(id, false);
+				slot.size = (size_t)file_stat.st_size;
+				SelectBuffer(id);
+			}
+			slot.state = SLOT_TRANSFER;
+			slot.done = 0;
+			if (slot.size == 0)
+				return Finish(id, true);
+			SubmitTransfer(id);
+		}
+		else if (slot.state == SLOT_TRANSFER) {
+			//nothing transferred means the file changed size underneath (or the disk is full)
+			if (result == 0)
+				return Finish(id, false);
+			slot.done += (size_t)result;
+			if (slot.done < slot.size)
+				SubmitTransfer(id);
+			else
+				Finish(id, true);
+		}
+	}
+
+	//submits what is queued, then handles at least one completion and any others that are ready
+	void WaitCompletion() {
+		io_uring_submit(&ring);
+		io_uring_cqe* cqe;
+		int result = io_uring_wait_cqe(&ring, &cqe);
+		if (result == -EINTR)
+			return;
+		if (result < 0) {
+			//the ring itself failed, nothing in flight will complete, so open files are closed here
+			for (size_t i = 0; i < slots.size(); i++)
+				if (slots[i].state == SLOT_OPEN || slots[i].state == SLOT_TRANSFER || slots[i].state == SLOT_CLOSE) {
+					if (slots[i].fd >= 0)
+						close(slots[i].fd);
+					slots[i].fd = -1;
+					slots[i].ok = false;
+					Complete(i);
+				}
+			return;
+		}
+		do {
+			HandleCompletion(cqe);
+			io_uring_cqe_seen(&ring, cqe);
+		} while (io_uring_peek_cqe(&ring, &cqe) == 0);
+	}
+
+	io_uring ring;
+	bool uring;
+	bool registered;
+	unsigned char* buffers; //one buffer_size buffer per slot
+	vector<IoSlot> slots; //read slots [0, depth], write slots after them
+#endif
+
+	size_t depth;
+	size_t buffer_size;
+	vector<string> read_names;
+	size_t next_read; //next file to submit
+	size_t next_result; //next file to hand out
+	chrono::steady_clock::time_point start;
+	unsigned long long files_read;
+	unsigned long long bytes_read;
+	unsigned long long files_written;
+	unsigned long long bytes_written;
+	bool write_failed;
+};
@@ -0,0 +1,204 @@
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <vector>
+
+#include "Utils.h"
+#include "DeviceMemoryTracker.h"
+
+//device buffer pool with size classes, recycling cl::Buffers across images and pipelines
+//instead of creating and releasing them for every run.
+//requests are rounded up to a size class (four classes per power of two, so at most 25% slack)
+//and served from a free list of buffers with the same flags and class when one is available.
+
+class BufferPool;
+
+//a buffer checked out of a BufferPool, it goes back to the pool when it goes out of scope
+//the underlying buffer may be larger than requested (Capacity() >= Size())
+class PooledBuffer {
+public:
+	PooledBuffer() : pool(nullptr), flags(0), size(0), capacity(0) {}
+
+	PooledBuffer(BufferPool* pool, const cl::Buffer& buffer, cl_mem_flags flags, size_t size, size_t capacity)
+		: pool(pool), buffer(buffer), flags(flags), size(size), capacity(capacity) {
+	}
+
+	PooledBuffer(PooledBuffer&& other) : PooledBuffer() {
+		*this = move(other);
+	}
+
+	PooledBuffer& operator=(PooledBuffer&& other) {
+		if (this != &other) {
+			Release();
+			pool = other.pool;
+			buffer = other.buffer;
+			flags = other.flags;
+			size = other.size;
+			capacity = other.capacity;
+			other.pool = nullptr;
+			other.buffer = cl::Buffer();
+		}
+		return *this;
+	}
+
+	PooledBuffer(const PooledBuffer&) = delete;
+	PooledBuffer& operator=(const PooledBuffer&) = delete;
+
+	~PooledBuffer() {
+		Release();
+	}
+
+	const cl::Buffer& Get() const { return buffer; }
+	size_t Size() const { return size; }
+	size_t Capacity() const { return capacity; }
+
+	//returns the buffer to the pool early
+	inline void Release();
+
+private:
+	BufferPool* pool;
+	cl::Buffer buffer;
+	cl_mem_flags flags;
+	size_t size;
+	size_t capacity;
+};
+
+struct BufferPoolStats {
+	unsigned long long hits = 0;
+	unsigned long long misses = 0;
+	unsigned long long evictions = 0;
+	size_t live_bytes = 0; //checked out
+	size_t idle_bytes = 0; //held in the free lists
+	size_t high_water_mark = 0; //peak of live + idle bytes
+};
+
+class BufferPool {
+public:
+	//memory_cap limits the device memory held by the pool (checked out plus idle), 0 means unlimited
+	BufferPool(const cl::Context& context, size_t memory_cap = 0, size_t min_class_size = 4096)
+		: context(context), memory_cap(memory_cap), min_class_size(min_class_size), tracker(nullptr) {
+	}
+
+	//creates new buffers through the tracker, which must outlive the pool
+	void SetTracker(DeviceMemoryTracker* tracker) {
+		lock_guard<mutex> lock(pool_mutex);
+		this->tracker = tracker;
+	}
+
+	PooledBuffer Acquire(size_t size, cl_mem_flags flags = CL_MEM_READ_WRITE) {
+		size_t capacity = SizeClass(size);
+		lock_guard<mutex> lock(pool_mutex);
+
+		vector<cl::Buffer>& free_list = free_lists[make_pair(flags, capacity)];
+		if (!free_list.empty()) {
+			cl::Buffer buffer = free_list.back();
+			free_list.pop_back();
+			stats.hits++;
+			stats.idle_bytes -= capacity;
+			stats.live_bytes += capacity;
+			return PooledBuffer(this, buffer, flags, size, capacity);
+		}
+
+		stats.misses++;
+
+		//make room under the cap by releasing idle buffers of other classes
+		if (memory_cap) {
+			for (auto it = free_lists.begin(); it != free_lists.end() && (stats.live_bytes + stats.idle_bytes + capacity > memory_cap); ++it) {
+				while (!it->second.empty() && (stats.live_bytes + stats.idle_bytes + capacity > memory_cap)) {
+					it->second.pop_back();
+					stats.idle_bytes -= it->first.second;
+					stats.evictions++;
+				}
+			}
+			if (stats.live_bytes + capacity > memory_cap)
+				throw cl::Error(CL_MEM_OBJECT_ALLOCATION_FAILURE, "BufferPool: memory cap exceeded");
+		}
+
+		//the device itself may be short of memory below the cap, idle buffers are given back first
+		if (tracker && !tracker->Fits(capacity)) {
+			for (auto& entry : free_lists) {
+				stats.evictions += entry.second.size();
+				stats.idle_bytes -= entry.first.second * entry.second.size();
+				entry.second.clear();
+			}
+		}
+
+		cl::Buffer buffer = tracker ? tracker->CreateBuffer(context, flags, capacity) : cl::Buffer(context, flags, capacity);
+		stats.live_bytes += capacity;
+		stats.high_water_mark = max(stats.high_water_mark, stats.live_bytes + stats.idle_bytes);
+		return PooledBuffer(this, buffer, flags, size, capacity);
+	}
+
+	//releases all idle buffers back to the driver
+	void Trim() {
+		lock_guard<mutex> lock(pool_mutex);
+		for (auto& entry : free_lists) {
+			stats.evictions += entry.second.size();
+			entry.second.clear();
+		}
+		stats.idle_bytes = 0;
+	}
+
+	BufferPoolStats Stats() {
+		lock_guard<mutex> lock(pool_mutex);
+		return stats;
+	}
+
+	string Report() {
+		BufferPoolStats current = Stats();
+		unsigned long long requests = current.hits + current.misses;
+		stringstream sstream;
+
+		sstream << "Buffer pool: " << requests << " requests, " << current.hits << " hits, " << current.misses << " misses";
+		if (requests)
+			sstream << " (hit rate " << (100.0 * current.hits / requests) << "%)";
+		sstream << ", " << current.evictions << " evictions" << endl;
+		sstream << "   live [B]: " << current.live_bytes << ", idle [B]: " << current.idle_bytes;
+		sstream << ", high-water mark [B]: " << current.high_water_mark;
+		if (memory_cap)
+			sstream << ", cap [B]: " << memory_cap;
+		sstream << endl;
+
+		return sstream.str();
+	}
+
+	//rounds a request up to its size class: 4 classes per power of two above min_class_size
+	size_t SizeClass(size_t size) const {
+		if (size <= min_class_size)
+			return min_class_size;
+
+		size_t power = min_class_size;
+		while (power * 2 < size)
+			power *= 2;
+
+		size_t step = power / 4;
+		return ((size + step - 1) / step) * step;
+	}
+
+private:
+	friend class PooledBuffer;
+
+	void Return(const cl::Buffer& buffer, cl_mem_flags flags, size_t capacity) {
+		lock_guard<mutex> lock(pool_mutex);
+		stats.live_bytes -= capacity;
+		free_lists[make_pair(flags, capacity)].push_back(buffer);
+		stats.idle_bytes += capacity;
+	}
+
+	cl::Context context;
+	size_t memory_cap;
+	size_t min_class_size;
+	map<pair<cl_mem_flags, size_t>, vector<cl::Buffer>> free_lists;
+	BufferPoolStats stats;
+	DeviceMemoryTracker* tracker;
+	mutex pool_mutex;
+};
+
+void PooledBuffer::Release() {
+	if (pool)
+		pool->Return(buffer, flags, capacity);
+	pool = nullptr;
+	buffer = cl::Buffer();
+}
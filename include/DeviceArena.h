@@ -0,0 +1,76 @@
+#pragma once
+
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+#include "BufferPool.h"
+
+//a single device allocation per pipeline instance, carved into sub-buffers for the intermediates
+//slices are reserved first, then Commit() makes one (pooled) allocation and creates a sub-buffer
+//per slice at offsets aligned to CL_DEVICE_MEM_BASE_ADDR_ALIGN, as createSubBuffer requires.
+class DeviceArena {
+public:
+	DeviceArena(BufferPool& pool, const cl::Device& device) : pool(pool), total_size(0) {
+		const DeviceInfo* info = DeviceRegistry::Get().Find(device);
+		cl_uint align_bits = info ? info->mem_base_addr_align : device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>();
+		alignment = max((size_t)align_bits / 8, (size_t)1);
+	}
+
+	//reserves an aligned slice and returns its index, must be called before Commit()
+	int Reserve(const string& name, size_t size) {
+		Slice slice;
+		slice.name = name;
+		slice.offset = ((total_size + alignment - 1) / alignment) * alignment;
+		slice.size = size;
+		slices.push_back(slice);
+		total_size = slice.offset + size;
+		return (int)slices.size() - 1;
+	}
+
+	//makes the single backing allocation and creates the sub-buffers
+	void Commit() {
+		backing = pool.Acquire(total_size, CL_MEM_READ_WRITE);
+		cl::Buffer parent = backing.Get();
+		for (unsigned int i = 0; i < slices.size(); i++) {
+			cl_buffer_region region = { slices[i].offset, slices[i].size };
+			slices[i].buffer = parent.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region);
+		}
+	}
+
+	const cl::Buffer& Get(int slice) const {
+		return slices[slice].buffer;
+	}
+
+	size_t Size(int slice) const {
+		return slices[slice].size;
+	}
+
+	//bytes used by the reserved slices including alignment padding
+	size_t Bytes() const {
+		return total_size;
+	}
+
+	string Report() const {
+		stringstream sstream;
+		sstream << "Device arena [B]: " << total_size << " in " << slices.size() << " slices (alignment " << alignment << ")" << endl;
+		for (unsigned int i = 0; i < slices.size(); i++)
+			sstream << "   " << slices[i].name << ": offset " << slices[i].offset << ", size " << slices[i].size << endl;
+		return sstream.str();
+	}
+
+private:
+	struct Slice {
+		string name;
+		size_t offset;
+		size_t size;
+		cl::Buffer buffer;
+	};
+
+	BufferPool& pool;
+	PooledBuffer backing;
+	vector<Slice> slices;
+	size_t alignment;
+	size_t total_size;
+};
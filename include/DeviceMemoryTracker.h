@@ -0,0 +1,123 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+
+//device memory footprint of the pipeline: live bytes, overall and per-stage peaks and allocation counts
+//buffers are created through the tracker, which checks them against CL_DEVICE_MAX_MEM_ALLOC_SIZE and
+//CL_DEVICE_GLOBAL_MEM_SIZE up front and counts their release from a destructor callback, so a cl::Buffer
+//copied around (e.g. into a pool) is only uncounted when the runtime actually frees it.
+//the counters the callback updates are shared with every pending callback, so buffers may outlive the tracker.
+class DeviceMemoryTracker {
+public:
+	explicit DeviceMemoryTracker(const cl::Device& device) : counters(make_shared<Counters>()), peak_bytes(0), allocations(0), stage(-1) {
+		const DeviceInfo* info = DeviceRegistry::Get().Find(device);
+		global_mem_size = info ? info->global_mem_size : device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+		max_mem_alloc_size = info ? info->max_mem_alloc_size : device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+	}
+
+	DeviceMemoryTracker(const DeviceMemoryTracker&) = delete;
+	DeviceMemoryTracker& operator=(const DeviceMemoryTracker&) = delete;
+
+	//true when a buffer of this size can be created without exceeding the device limits
+	bool Fits(size_t size) {
+		lock_guard<mutex> lock(counters->counters_mutex);
+		return size <= max_mem_alloc_size && counters->live_bytes + size <= global_mem_size;
+	}
+
+	cl::Buffer CreateBuffer(const cl::Context& context, cl_mem_flags flags, size_t size, void* host_ptr = nullptr) {
+		{
+			lock_guard<mutex> lock(counters->counters_mutex);
+			if (size > max_mem_alloc_size)
+				throw cl::Error(CL_INVALID_BUFFER_SIZE, "DeviceMemoryTracker: buffer exceeds CL_DEVICE_MAX_MEM_ALLOC_SIZE");
+			if (counters->live_bytes + size > global_mem_size)
+				throw cl::Error(CL_MEM_OBJECT_ALLOCATION_FAILURE, "DeviceMemoryTracker: live buffers would exceed CL_DEVICE_GLOBAL_MEM_SIZE");
+		}
+
+		cl::Buffer buffer(context, flags, size, host_ptr);
+
+		lock_guard<mutex> lock(counters->counters_mutex);
+		counters->live_bytes += size;
+		peak_bytes = max(peak_bytes, counters->live_bytes);
+		allocations++;
+		if (stage >= 0) {
+			stages[stage].peak_bytes = max(stages[stage].peak_bytes, counters->live_bytes);
+			stages[stage].allocations++;
+		}
+		buffer.setDestructorCallback(OnRelease, new Release{ counters, size });
+		return buffer;
+	}
+
+	//attributes the following allocations to a named stage, its peak starts at the bytes live now
+	void SetStage(const string& name) {
+		lock_guard<mutex> lock(counters->counters_mutex);
+		stage = -1;
+		for (unsigned int i = 0; i < stages.size(); i++)
+			if (stages[i].name == name)
+				stage = (int)i;
+		if (stage < 0) {
+			stages.push_back(Stage{ name, 0, 0 });
+			stage = (int)stages.size() - 1;
+		}
+		stages[stage].peak_bytes = max(stages[stage].peak_bytes, counters->live_bytes);
+	}
+
+	size_t LiveBytes() {
+		lock_guard<mutex> lock(counters->counters_mutex);
+		return counters->live_bytes;
+	}
+
+	string Report() {
+		lock_guard<mutex> lock(counters->counters_mutex);
+		stringstream sstream;
+		sstream << "Device memory [B]: live " << counters->live_bytes << ", peak " << peak_bytes
+			<< " (" << (global_mem_size ? 100.0 * peak_bytes / global_mem_size : 0.0) << "% of " << global_mem_size << ")"
+			<< ", max allocation " << max_mem_alloc_size << ", " << allocations << " allocations, " << counters->releases << " releases" << endl;
+		for (unsigned int i = 0; i < stages.size(); i++)
+			sstream << "   " << stages[i].name << ": peak " << stages[i].peak_bytes << ", allocations " << stages[i].allocations << endl;
+		return sstream.str();
+	}
+
+private:
+	struct Stage {
+		string name;
+		size_t peak_bytes;
+		unsigned long long allocations;
+	};
+
+	//what the release callbacks update, the mutex also guards the rest of the tracker
+	struct Counters {
+		size_t live_bytes = 0;
+		unsigned long long releases = 0;
+		mutex counters_mutex;
+	};
+
+	struct Release {
+		shared_ptr<Counters> counters;
+		size_t size;
+	};
+
+	//called by the runtime (possibly from its own thread) once the buffer is freed
+	static void CL_CALLBACK OnRelease(cl_mem, void* user_data) {
+		Release* release = (Release*)user_data;
+		{
+			lock_guard<mutex> lock(release->counters->counters_mutex);
+			release->counters->live_bytes -= release->size;
+			release->counters->releases++;
+		}
+		delete release;
+	}
+
+	shared_ptr<Counters> counters;
+	cl_ulong global_mem_size;
+	cl_ulong max_mem_alloc_size;
+	size_t peak_bytes;
+	unsigned long long allocations;
+	vector<Stage> stages;
+	int stage; //current stage, -1 before the first SetStage
+};
@@ -0,0 +1,161 @@
+#pragma once
+
+#include <condition_variable>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
+
+#include "Utils.h"
+
+//frame streams over pipes: YUV4MPEG2 (Y4M) or headerless raw planar frames of a given size
+//only the planes that come first in every frame and share the frame size are equalised (luma for Y4M, every
+//channel for raw frames); chroma planes are passed through unchanged.
+
+struct FrameFormat {
+	bool y4m = false;
+	int width = 0;
+	int height = 0;
+	int spectrum = 0; //number of full-size planes at the start of each frame that are equalised
+	size_t frame_bytes = 0; //payload of one frame, all planes
+	string stream_header; //the Y4M stream header line, written back unchanged
+
+	size_t EqualisedBytes() const { return (size_t)width * height * spectrum; }
+};
+
+//pipes are binary on POSIX, the Windows C runtime translates line endings unless told otherwise
+void SetBinaryStdio() {
+#ifdef _WIN32
+	_setmode(_fileno(stdin), _O_BINARY);
+	_setmode(_fileno(stdout), _O_BINARY);
+#endif
+}
+
+//by default POSIX kills a process that writes to a pipe whose reader has gone away; ignoring SIGPIPE makes the write
+//fail with EPIPE instead, so the pipeline can stop reading, drain the frames in flight and report
+void IgnoreBrokenPipes() {
+#ifndef _WIN32
+	signal(SIGPIPE, SIG_IGN);
+#endif
+}
+
+//reads one '\n'-terminated line of at most max_length characters, without the terminator
+bool ReadLine(FILE* file, string& line, size_t max_length = 1024) {
+	line.clear();
+	int c;
+	while ((c = fgetc(file)) != EOF && c != '\n') {
+		if (line.size() == max_length)
+			return false;
+		line += (char)c;
+	}
+	return c == '\n';
+}
+
+//parses the "YUV4MPEG2 W.. H.. C.." stream header, 8-bit 4:2:0 (the default), 4:2:2, 4:4:4 and mono are supported
+bool ReadY4mHeader(FILE* file, FrameFormat& format) {
+	string line;
+	if (!ReadLine(file, line) || line.compare(0, 10, "YUV4MPEG2 ") != 0)
+		return false;
+
+	string colour_space = "420";
+	stringstream tokens(line.substr(10));
+	string token;
+	while (tokens >> token) {
+		if (token[0] == 'W')
+			format.width = atoi(token.c_str() + 1);
+		else if (token[0] == 'H')
+			format.height = atoi(token.c_str() + 1);
+		else if (token[0] == 'C')
+			colour_space = token.substr(1);
+	}
+	if (format.width <= 0 || format.height <= 0)
+		return false;
+
+	size_t luma = (size_t)format.width * format.height;
+	size_t half_width = (format.width + 1) / 2, half_height = (format.height + 1) / 2;
+	if (colour_space == "420" || colour_space == "420jpeg" || colour_space == "420paldv" || colour_space == "420mpeg2")
+		format.frame_bytes = luma + 2 * half_width * half_height;
+	else if (colour_space == "422")
+		format.frame_bytes = luma + 2 * half_width * format.height;
+	else if (colour_space == "444")
+		format.frame_bytes = 3 * luma;
+	else if (colour_space == "mono")
+		format.frame_bytes = luma;
+	else
+		return false;
+
+	format.y4m = true;
+	format.spectrum = 1;
+	format.stream_header = line;
+	return true;
+}
+
+FrameFormat RawFrameFormat(int width, int height, int spectrum) {
+	FrameFormat format;
+	format.width = width;
+	format.height = height;
+	format.spectrum = spectrum;
+	format.frame_bytes = (size_t)width * height * spectrum;
+	return format;
+}
+
+//reads the next frame (and for Y4M its "FRAME" line) into data, false at the end of the stream
+bool ReadFrame(FILE* file, const FrameFormat& format, string& frame_header, unsigned char* data) {
+	if (format.y4m && (!ReadLine(file, frame_header) || frame_header.compare(0, 5, "FRAME") != 0))
+		return false;
+	return fread(data, 1, format.frame_bytes, file) == format.frame_bytes;
+}
+
+bool WriteFrame(FILE* file, const FrameFormat& format, const string& frame_header, const unsigned char* data) {
+	if (format.y4m && fprintf(file, "%s\n", frame_header.c_str()) < 0)
+		return false;
+	return fwrite(data, 1, format.frame_bytes, file) == format.frame_bytes;
+}
+
+//unbounded queue between the stages of a pipeline, Pop() blocks until an item arrives or the queue is closed
+template <typename T>
+class BlockingQueue {
+public:
+	BlockingQueue() : closed(false) {}
+
+	void Push(const T& item) {
+		{
+			lock_guard<mutex> lock(queue_mutex);
+			items.push_back(item);
+		}
+		ready.notify_one();
+	}
+
+	//false once the queue is closed and empty
+	bool Pop(T& item) {
+		unique_lock<mutex> lock(queue_mutex);
+		ready.wait(lock, [this] { return closed || !items.empty(); });
+		if (items.empty())
+			return false;
+		item = items.front();
+		items.pop_front();
+		return true;
+	}
+
+	void Close() {
+		{
+			lock_guard<mutex> lock(queue_mutex);
+			closed = true;
+		}
+		ready.notify_all();
+	}
+
+private:
+	deque<T> items;
+	bool closed;
+	mutex queue_mutex;
+	condition_variable ready;
+};
@@ -0,0 +1,371 @@
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <new>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <malloc.h>
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <sched.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#include "Utils.h"
+
+//page-aligned host memory, as required for CL_MEM_USE_HOST_PTR buffers to be used in place (zero-copy)
+//by CPU and integrated GPU runtimes
+
+const size_t HOST_PAGE_SIZE = 4096;
+const size_t HUGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+//placement of host image memory on multi-socket machines
+//numa_node -1 leaves placement to the OS (first touch), huge_pages backs the memory with 2 MB pages where possible
+struct HostMemoryPolicy {
+	int numa_node = -1;
+	bool huge_pages = false;
+
+	bool IsDefault() const { return numa_node < 0 && !huge_pages; }
+};
+
+void* AlignedAlloc(size_t size, size_t alignment = HOST_PAGE_SIZE) {
+#ifdef _WIN32
+	void* ptr = _aligned_malloc(size, alignment);
+#else
+	void* ptr = nullptr;
+	if (posix_memalign(&ptr, alignment, size) != 0)
+		ptr = nullptr;
+#endif
+	if (!ptr)
+		throw bad_alloc();
+	return ptr;
+}
+
+void AlignedFree(void* ptr) {
+#ifdef _WIN32
+	_aligned_free(ptr);
+#else
+	free(ptr);
+#endif
+}
+
+size_t RoundUp(size_t size, size_t multiple) {
+	return ((size + multiple - 1) / multiple) * multiple;
+}
+
+//sets the policy's NUMA node as the preferred node of the pages covering [ptr, ptr + size), best effort and Linux only
+//move_existing also migrates pages that are already resident, e.g. memory allocated and touched by the OpenCL runtime;
+//pages the driver has pinned for DMA can not be moved and stay where they are.
+void PlacePages(void* ptr, size_t size, const HostMemoryPolicy& policy, bool move_existing = false) {
+#if !defined(_WIN32) && defined(SYS_mbind)
+	if (policy.numa_node < 0 || policy.numa_node >= 64 || !size)
+		return;
+	uintptr_t first = (uintptr_t)ptr & ~(uintptr_t)(HOST_PAGE_SIZE - 1);
+	size_t length = RoundUp((uintptr_t)ptr + size - first, HOST_PAGE_SIZE);
+	//MPOL_PREFERRED (1) rather than MPOL_BIND, so a full node falls back instead of failing; MPOL_MF_MOVE is 2
+	unsigned long node_mask = 1UL << policy.numa_node;
+	syscall(SYS_mbind, (void*)first, length, 1, &node_mask, sizeof(node_mask) * 8, move_existing ? 2 : 0);
+#else
+	(void)ptr;
+	(void)size;
+	(void)policy;
+	(void)move_existing;
+#endif
+}
+
+//restricts the calling thread to the CPUs of a NUMA node, false where that is not possible
+bool BindThreadToNode(int numa_node) {
+	if (numa_node < 0)
+		return false;
+#ifdef _WIN32
+	GROUP_AFFINITY affinity;
+	return GetNumaNodeProcessorMaskEx((USHORT)numa_node, &affinity) && SetThreadGroupAffinity(GetCurrentThread(), &affinity, NULL);
+#elif defined(__linux__)
+	//the node's CPUs as ranges, e.g. "0-7,16-23"
+	ifstream file("/sys/devices/system/node/node" + to_string(numa_node) + "/cpulist");
+	string list;
+	if (!getline(file, list))
+		return false;
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	stringstream ranges(list);
+	string range;
+	while (getline(ranges, range, ',')) {
+		int first = 0, last = 0;
+		int fields = sscanf(range.c_str(), "%d-%d", &first, &last);
+		if (fields < 1)
+			continue;
+		if (fields == 1)
+			last = first;
+		for (int cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &cpus);
+	}
+	return CPU_COUNT(&cpus) > 0 && sched_setaffinity(0, sizeof(cpus), &cpus) == 0;
+#else
+	return false;
+#endif
+}
+
+//whole pages straight from the OS, placed according to the policy; size is rounded up to the pages used
+//huge pages are best effort: explicit large pages are tried first (they need SeLockMemoryPrivilege on Windows
+//or a reserved hugetlb pool on Linux), then transparent huge pages on Linux, then normal pages.
+//on Linux the NUMA node is a preference set with mbind, the pages land there when they are first touched.
+void* AllocatePages(size_t& size, const HostMemoryPolicy& policy) {
+#ifdef _WIN32
+	DWORD node = policy.numa_node >= 0 ? (DWORD)policy.numa_node : NUMA_NO_PREFERRED_NODE;
+	void* ptr = nullptr;
+	size_t large_page = policy.huge_pages ? GetLargePageMinimum() : 0;
+	if (large_page) {
+		size_t large_size = RoundUp(size, large_page);
+		ptr = VirtualAllocExNuma(GetCurrentProcess(), NULL, large_size, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE, node);
+		if (ptr)
+			size = large_size;
+	}
+	if (!ptr) {
+		size = RoundUp(size, HOST_PAGE_SIZE);
+		ptr = VirtualAllocExNuma(GetCurrentProcess(), NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE, node);
+	}
+	if (!ptr)
+		throw bad_alloc();
+	return ptr;
+#else
+	void* ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+	if (policy.huge_pages) {
+		size_t huge_size = RoundUp(size, HUGE_PAGE_SIZE);
+		ptr = mmap(nullptr, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (ptr != MAP_FAILED)
+			size = huge_size;
+	}
+#endif
+	if (ptr == MAP_FAILED) {
+		size = RoundUp(size, policy.huge_pages ? HUGE_PAGE_SIZE : HOST_PAGE_SIZE);
+		ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			throw bad_alloc();
+#ifdef MADV_HUGEPAGE
+		if (policy.huge_pages)
+			madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+	}
+	PlacePages(ptr, size, policy);
+	return ptr;
+#endif
+}
+
+void FreePages(void* ptr, size_t size) {
+#ifdef _WIN32
+	VirtualFree(ptr, 0, MEM_RELEASE);
+#else
+	munmap(ptr, size);
+#endif
+}
+
+//owning, move-only block of page-aligned host memory
+//the allocation is rounded up to a whole cache line, which zero-copy runtimes also expect;
+//with a non-default policy it is made of whole pages from AllocatePages instead
+class HostBuffer {
+public:
+	HostBuffer() : data(nullptr), size(0), mapped_size(0) {}
+
+	explicit HostBuffer(size_t size, const HostMemoryPolicy& policy = HostMemoryPolicy()) : data(nullptr), size(size), mapped_size(0) {
+		if (!size)
+			return;
+		if (policy.IsDefault()) {
+			data = (unsigned char*)AlignedAlloc(RoundUp(size, 64));
+		}
+		else {
+			mapped_size = size;
+			data = (unsigned char*)AllocatePages(mapped_size, policy);
+		}
+	}
+
+	HostBuffer(HostBuffer&& other) : data(other.data), size(other.size), mapped_size(other.mapped_size) {
+		other.data = nullptr;
+		other.size = 0;
+		other.mapped_size = 0;
+	}
+
+	HostBuffer& operator=(HostBuffer&& other) {
+		if (this != &other) {
+			Free();
+			data = other.data;
+			size = other.size;
+			mapped_size = other.mapped_size;
+			other.data = nullptr;
+			other.size = 0;
+			other.mapped_size = 0;
+		}
+		return *this;
+	}
+
+	HostBuffer(const HostBuffer&) = delete;
+	HostBuffer& operator=(const HostBuffer&) = delete;
+
+	~HostBuffer() {
+		Free();
+	}
+
+	unsigned char* Data() const { return data; }
+	size_t Size() const { return size; }
+
+private:
+	void Free() {
+		if (data && mapped_size)
+			FreePages(data, mapped_size);
+		else if (data)
+			AlignedFree(data);
+		data = nullptr;
+	}
+
+	unsigned char* data;
+	size_t size;
+	size_t mapped_size; //0 unless allocated by AllocatePages
+};
+
+//per-worker host arena: a bump allocator over page-aligned slabs that is rewound between images
+//the slabs are kept across Reset(), so after the first image of a batch the decoded image, the result
+//and the histograms are served without touching the heap or faulting in fresh pages.
+//not thread-safe, each worker owns its own arena.
+class HostArena {
+public:
+	explicit HostArena(size_t slab_size = 1 << 20, const HostMemoryPolicy& policy = HostMemoryPolicy())
+		: slab_size(slab_size), policy(policy), current(0), offset(0), used(0), peak(0), slab_allocations(0) {
+	}
+
+	HostArena(const HostArena&) = delete;
+	HostArena& operator=(const HostArena&) = delete;
+
+	//alignment must be a power of two no larger than HOST_PAGE_SIZE
+	void* Allocate(size_t size, size_t alignment = 64) {
+		while (current < slabs.size()) {
+			size_t start = (offset + alignment - 1) & ~(alignment - 1);
+			if (start + size <= slabs[current].Size()) {
+				offset = start + size;
+				used += size;
+				peak = max(peak, used);
+				return slabs[current].Data() + start;
+			}
+			//the rest of this slab is skipped
+			current++;
+			offset = 0;
+		}
+
+		AddSlab(max(size, slab_size));
+		offset = size;
+		used += size;
+		peak = max(peak, used);
+		return slabs[current].Data();
+	}
+
+	template <typename T>
+	T* Allocate(size_t count) {
+		return (T*)Allocate(count * sizeof(T), max(alignof(T), (size_t)64));
+	}
+
+	//releases everything allocated since the last reset, the memory is kept for reuse
+	//an image that needed several slabs gets them merged into one, so the next one is a single bump
+	void Reset() {
+		if (slabs.size() > 1) {
+			size_t total = 0;
+			for (unsigned int i = 0; i < slabs.size(); i++)
+				total += slabs[i].Size();
+			slabs.clear();
+			AddSlab(total);
+		}
+		current = 0;
+		offset = 0;
+		used = 0;
+	}
+
+	size_t Capacity() const {
+		size_t total = 0;
+		for (unsigned int i = 0; i < slabs.size(); i++)
+			total += slabs[i].Size();
+		return total;
+	}
+
+	string Report() const {
+		stringstream sstream;
+		sstream << "Host arena [B]: capacity " << Capacity() << " in " << slabs.size() << " slab(s), peak " << peak
+			<< ", slab allocations " << slab_allocations << endl;
+		return sstream.str();
+	}
+
+private:
+	void AddSlab(size_t size) {
+		size = RoundUp(size, policy.huge_pages ? HUGE_PAGE_SIZE : HOST_PAGE_SIZE);
+		HostBuffer slab(size, policy);
+		//touch every page now, so page faults are taken once here instead of inside the pipeline
+		//(and, with a NUMA policy, the pages are placed on the preferred node)
+		memset(slab.Data(), 0, size);
+		slabs.push_back(move(slab));
+		current = slabs.size() - 1;
+		slab_allocations++;
+	}
+
+	vector<HostBuffer> slabs;
+	size_t slab_size;
+	HostMemoryPolicy policy;
+	size_t current; //slab being bumped
+	size_t offset; //within the current slab
+	size_t used;
+	size_t peak;
+	unsigned long long slab_allocations;
+};
+
+//first-touch and streaming read throughput of host memory allocated with the default and the given policy
+//the read pass is what the CPU runtime's workers do to the input image, so it shows NUMA and TLB effects. it runs on a
+//thread bound to the policy's node, where the workers of the node's CPU sub-device run, while the memory is allocated
+//and touched by the calling thread, so default memory lands wherever first touch puts it.
+string HostMemoryBenchmark(size_t size, const HostMemoryPolicy& policy, int repeats = 10) {
+	stringstream sstream;
+	sstream << "Host memory benchmark: " << size << " B x " << repeats << endl;
+	bool bound = false;
+
+	HostMemoryPolicy policies[2] = { HostMemoryPolicy(), policy };
+	const char* names[2] = { "default", "policy" };
+	for (int p = 0; p < 2; p++) {
+		auto start = chrono::steady_clock::now();
+		HostBuffer buffer(size, policies[p]);
+		memset(buffer.Data(), 1, size);
+		double touch_ms = ElapsedMs(start);
+
+		const unsigned long long* words = (const unsigned long long*)buffer.Data();
+		double read_ms = 0.0;
+		thread reader([&]() {
+			bound = BindThreadToNode(policy.numa_node);
+			volatile unsigned long long sink = 0;
+			auto read_start = chrono::steady_clock::now();
+			for (int r = 0; r < repeats; r++) {
+				unsigned long long sum = 0;
+				for (size_t i = 0; i < size / sizeof(unsigned long long); i++)
+					sum += words[i];
+				sink = sink + sum;
+			}
+			read_ms = ElapsedMs(read_start);
+		});
+		reader.join();
+
+		sstream << "   " << names[p] << " (node " << policies[p].numa_node << ", huge pages " << (policies[p].huge_pages ? "on" : "off")
+			<< "): allocate + first touch [ms]: " << touch_ms
+			<< ", read [MB/s]: " << (read_ms > 0.0 ? (size * (double)repeats / (1024.0 * 1024.0)) / (read_ms / 1000.0) : 0.0) << endl;
+	}
+	if (policy.numa_node >= 0)
+		sstream << "   reads " << (bound ? "ran on" : "could not be bound to") << " the CPUs of node " << policy.numa_node << endl;
+	return sstream.str();
+}
@@ -0,0 +1,198 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+
+#include "Utils.h"
+#include "HostMemory.h"
+#include "PnmIO.h"
+
+//binary image cache for images that are processed repeatedly
+//the file holds the image dimensions, its layout and per-channel histogram, followed by the pixels at a page-aligned
+//offset in exactly the layout the kernels read. a mapped cache file can therefore be uploaded (or wrapped as a
+//zero-copy buffer) as it is, with no decoding, conversion or histogram pass. fields are in host byte order.
+//
+//   ImageCacheHeader | histogram (256 int32 per channel, bin c*256+v) | padding | pixels (page-aligned)
+
+enum ImageCacheLayout {
+	IMAGE_CACHE_PLANAR = 0, //one whole channel after another, as in CImg
+	IMAGE_CACHE_INTERLEAVED = 1 //packed pixels, as in PPM files
+};
+
+struct ImageCacheHeader {
+	char magic[8]; //"EQCACHE1"
+	uint32_t width;
+	uint32_t height;
+	uint32_t depth;
+	uint32_t spectrum;
+	uint32_t bit_depth; //bits per sample, only 8 is written and read
+	uint32_t layout; //ImageCacheLayout
+	uint64_t histogram_offset;
+	uint64_t payload_offset;
+	uint64_t payload_size;
+};
+
+const char IMAGE_CACHE_MAGIC[8] = { 'E', 'Q', 'C', 'A', 'C', 'H', 'E', '1' };
+
+//true if the file starts with the cache magic, so callers can tell caches from other image files
+bool IsImageCache(const string& file_name) {
+	ifstream file(file_name, ios::binary);
+	char magic[sizeof(IMAGE_CACHE_MAGIC)];
+	file.read(magic, sizeof(magic));
+	return file.gcount() == sizeof(magic) && memcmp(magic, IMAGE_CACHE_MAGIC, sizeof(magic)) == 0;
+}
+
+//the same for a file already read into memory
+bool IsImageCache(const unsigned char* file_data, size_t file_size) {
+	return file_size >= sizeof(IMAGE_CACHE_MAGIC) && memcmp(file_data, IMAGE_CACHE_MAGIC, sizeof(IMAGE_CACHE_MAGIC)) == 0;
+}
+
+//per-channel histogram of an 8-bit image, in the bins the equalisation kernels produce
+vector<int32_t> ComputeHistogram(const unsigned char* pixels, size_t pixel_count, int spectrum, ImageCacheLayout layout) {
+	vector<int32_t> histogram(256 * spectrum, 0);
+	for (size_t i = 0; i < pixel_count; i++)
+		for (int c = 0; c < spectrum; c++) {
+			unsigned char v = layout == IMAGE_CACHE_PLANAR ? pixels[c * pixel_count + i] : pixels[i * spectrum + c];
+			histogram[c * 256 + v]++;
+		}
+	return histogram;
+}
+
+//a cache file written in parts, for images that are produced piece by piece (e.g. the slabs of a volume)
+//the histogram has to be known up front, the pixels can then be written in any order
+class ImageCacheWriter {
+public:
+	//writes the header and histogram (256 bins per channel), false if the file can not be created
+	bool Open(const string& file_name, int width, int height, int depth, int spectrum, ImageCacheLayout layout, const int32_t* histogram) {
+		size_t histogram_bytes = (size_t)256 * spectrum * sizeof(int32_t);
+		memcpy(header.magic, IMAGE_CACHE_MAGIC, sizeof(header.magic));
+		header.width = width;
+		header.height = height;
+		header.depth = depth;
+		header.spectrum = spectrum;
+		header.bit_depth = 8;
+		header.layout = layout;
+		header.histogram_offset = sizeof(ImageCacheHeader);
+		header.payload_offset = RoundUp(header.histogram_offset + histogram_bytes, HOST_PAGE_SIZE);
+		header.payload_size = (uint64_t)width * height * depth * spectrum;
+
+		file.open(file_name, ios::binary | ios::trunc);
+		file.write((const char*)&header, sizeof(header));
+		file.write((const char*)histogram, histogram_bytes);
+		vector<char> padding(header.payload_offset - header.histogram_offset - histogram_bytes, 0);
+		file.write(padding.data(), padding.size());
+		return (bool)file;
+	}
+
+	//writes size bytes of pixels at offset into the payload
+	bool Write(size_t offset, const unsigned char* pixels, size_t size) {
+		if (offset + size > header.payload_size)
+			return false;
+		file.seekp(header.payload_offset + offset);
+		file.write((const char*)pixels, size);
+		return (bool)file;
+	}
+
+	bool Close() {
+		file.close();
+		return !file.fail();
+	}
+
+	const ImageCacheHeader& Header() const { return header; }
+
+private:
+	ofstream file;
+	ImageCacheHeader header;
+};
+
+//writes pixels (width * height * depth * spectrum bytes in the given layout) and their histogram as a cache file
+bool WriteImageCache(const string& file_name, const unsigned char* pixels, int width, int height, int depth, int spectrum, ImageCacheLayout layout) {
+	size_t pixel_count = (size_t)width * height * depth;
+	vector<int32_t> histogram = ComputeHistogram(pixels, pixel_count, spectrum, layout);
+
+	ImageCacheWriter writer;
+	return writer.Open(file_name, width, height, depth, spectrum, layout, histogram.data()) &&
+		writer.Write(0, pixels, pixel_count * spectrum) && writer.Close();
+}
+
+//a memory-mapped cache file, or one already read into memory; Pixels() and Histogram() point into the file's memory
+//a mapping is read-only, so the pixels must not be wrapped by CL_MEM_USE_HOST_PTR buffers (drivers may pin them for
+//writing); they can be uploaded from or copied
+class MappedImageCache {
+public:
+	//false if the file is not a valid 8-bit cache, including one whose histogram does not count every pixel once per
+	//channel (a zeroed histogram would make the lut divide by zero)
+	bool Open(const string& file_name) {
+		if (!file.Open(file_name))
+			return false;
+		if (!Open(file.Data(), file.Size())) {
+			file.Close();
+			return false;
+		}
+		return true;
+	}
+
+	//the same for a file read by the caller, whose memory must outlive this object's use
+	bool Open(const unsigned char* file_data, size_t file_size) {
+		data = nullptr;
+		if (file_size < sizeof(ImageCacheHeader))
+			return false;
+		memcpy(&header, file_data, sizeof(header));
+		size_t histogram_bytes = (size_t)256 * header.spectrum * sizeof(int32_t);
+		if (memcmp(header.magic, IMAGE_CACHE_MAGIC, sizeof(header.magic)) != 0 || header.bit_depth != 8 ||
+			(header.layout != IMAGE_CACHE_PLANAR && header.layout != IMAGE_CACHE_INTERLEAVED) || header.spectrum == 0 ||
+			header.payload_size != (uint64_t)header.width * header.height * header.depth * header.spectrum ||
+			header.histogram_offset + histogram_bytes > file_size || header.payload_offset % HOST_PAGE_SIZE != 0 ||
+			header.payload_offset + header.payload_size > file_size)
+			return false;
+		data = file_data;
+
+		//int32 bins can only hold the counts of images of up to 2^31 - 1 pixels, larger ones are opened without theirs
+		uint64_t pixel_count = (uint64_t)header.width * header.height * header.depth;
+		has_histogram = HistogramCountsPixels(pixel_count);
+		if (!has_histogram && pixel_count <= (uint64_t)numeric_limits<int32_t>::max()) {
+			data = nullptr;
+			return false;
+		}
+		return true;
+	}
+
+	const ImageCacheHeader& Header() const { return header; }
+	int Width() const { return header.width; }
+	int Height() const { return header.height; }
+	int Depth() const { return header.depth; }
+	int Spectrum() const { return header.spectrum; }
+	ImageCacheLayout Layout() const { return (ImageCacheLayout)header.layout; }
+	size_t PixelBytes() const { return (size_t)header.payload_size; }
+
+	//nullptr when the image is too large for its histogram to be stored
+	const int32_t* Histogram() const { return has_histogram ? (const int32_t*)(data + header.histogram_offset) : nullptr; }
+	//page-aligned when the file's memory is (a mapping always is)
+	const unsigned char* Pixels() const { return data + header.payload_offset; }
+
+private:
+	//true if every channel's bins are non-negative and sum to pixel_count
+	bool HistogramCountsPixels(uint64_t pixel_count) const {
+		const int32_t* bins = (const int32_t*)(data + header.histogram_offset);
+		for (uint32_t c = 0; c < header.spectrum; c++) {
+			uint64_t total = 0;
+			for (int v = 0; v < 256; v++) {
+				if (bins[c * 256 + v] < 0)
+					return false;
+				total += (uint64_t)bins[c * 256 + v];
+			}
+			if (total != pixel_count)
+				return false;
+		}
+		return true;
+	}
+
+	MappedFile file;
+	const unsigned char* data = nullptr;
+	ImageCacheHeader header;
+	bool has_histogram = false;
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+#include "Utils.h"
+
+//a kernel that remembers its arguments, so Bind() only calls clSetKernelArg when a value changes
+//buffers are compared by handle only and are not kept referenced, so pooled buffers can be evicted and host memory
+//wrapped by CL_MEM_USE_HOST_PTR buffers freed. once a bound buffer may have been released its handle can be recycled by
+//the runtime for a different buffer, so the remembered arguments have to be forgotten (ForgetArguments) at that point,
+//e.g. after every image.
+class BoundKernel {
+public:
+	explicit BoundKernel(const cl::Kernel& kernel) : kernel(kernel), sets(0), skips(0) {}
+
+	BoundKernel(const BoundKernel&) = delete;
+	BoundKernel& operator=(const BoundKernel&) = delete;
+
+	cl::Kernel& Kernel() { return kernel; }
+
+	void Bind(cl_uint index, const cl::Buffer& buffer) {
+		cl_mem handle = buffer();
+		if (Unchanged(index, &handle, sizeof(handle)))
+			return;
+		kernel.setArg(index, buffer);
+		Store(index, &handle, sizeof(handle));
+	}
+
+	//local memory is identified by its size only
+	void Bind(cl_uint index, const cl::LocalSpaceArg& local) {
+		if (Unchanged(index, &local.size_, sizeof(local.size_)))
+			return;
+		kernel.setArg(index, local);
+		Store(index, &local.size_, sizeof(local.size_));
+	}
+
+	//plain values and, in SVM builds, pointers
+	template <typename T>
+	void Bind(cl_uint index, const T& value) {
+		if (Unchanged(index, &value, sizeof(value)))
+			return;
+		kernel.setArg(index, value);
+		Store(index, &value, sizeof(value));
+	}
+
+	//the next Bind() of every argument sets it again
+	void ForgetArguments() {
+		args.clear();
+	}
+
+	unsigned long long Sets() const { return sets; }
+	unsigned long long Skips() const { return skips; }
+
+private:
+	struct Arg {
+		bool bound = false;
+		vector<unsigned char> bytes;
+	};
+
+	bool Unchanged(cl_uint index, const void* value, size_t size) {
+		if (index < args.size() && args[index].bound && args[index].bytes.size() == size && memcmp(args[index].bytes.data(), value, size) == 0) {
+			skips++;
+			return true;
+		}
+		return false;
+	}
+
+	void Store(cl_uint index, const void* value, size_t size) {
+		if (index >= args.size())
+			args.resize(index + 1);
+		args[index].bound = true;
+		args[index].bytes.assign((const unsigned char*)value, (const unsigned char*)value + size);
+		sets++;
+	}
+
+	cl::Kernel kernel;
+	vector<Arg> args;
+	unsigned long long sets;
+	unsigned long long skips;
+};
+
+//pre-created kernels keyed by (program, kernel name, host thread)
+//setting arguments on a shared cl::Kernel is not thread-safe, so every host thread gets its own instance
+class KernelCache {
+public:
+	BoundKernel& Get(const cl::Program& program, const string& name) {
+		lock_guard<mutex> lock(cache_mutex);
+		unique_ptr<BoundKernel>& kernel = kernels[make_tuple(program(), name, this_thread::get_id())];
+		if (!kernel) {
+			kernel.reset(new BoundKernel(cl::Kernel(program, name.c_str())));
+			//keeps the program handle in the key valid for the life of the cache
+			programs.push_back(program);
+		}
+		return *kernel;
+	}
+
+	//forgets the arguments of every kernel, see BoundKernel
+	//must not be called while another thread is binding arguments
+	void ForgetArguments() {
+		lock_guard<mutex> lock(cache_mutex);
+		for (auto& entry : kernels)
+			entry.second->ForgetArguments();
+	}
+
+	string Report() {
+		lock_guard<mutex> lock(cache_mutex);
+		unsigned long long sets = 0, skips = 0;
+		for (auto& entry : kernels) {
+			sets += entry.second->Sets();
+			skips += entry.second->Skips();
+		}
+		stringstream sstream;
+		sstream << "Kernel cache: " << kernels.size() << " kernels, " << sets << " arguments set, " << skips << " unchanged arguments skipped" << endl;
+		return sstream.str();
+	}
+
+private:
+	map<tuple<cl_program, string, thread::id>, unique_ptr<BoundKernel>> kernels;
+	vector<cl::Program> programs;
+	mutex cache_mutex;
+};
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstring>
+#include <string>
+
+#include "Utils.h"
+
+//kernel sources embedded into the executable at build time
+//kernel_sources.h is generated from the kernels directory by embed_kernels.ps1 (see the custom build step in the project)
+//or embed_kernels.cmake in CMake builds,
+//builds without it fall back to reading the .cl files from the current directory as before
+struct EmbeddedKernelSource {
+	const char* file_name;
+	const char* source;
+};
+
+#if defined(__has_include)
+#if __has_include("kernel_sources.h")
+#include "kernel_sources.h"
+#define HAVE_EMBEDDED_KERNEL_SOURCES
+#endif
+#endif
+
+//adds a kernel file to sources: from kernel_dir when one is given (development override),
+//otherwise from the copy embedded at build time
+void AddKernelSources(cl::Program::Sources& sources, const string& file_name, const string& kernel_dir = "") {
+	if (!kernel_dir.empty()) {
+		AddSources(sources, kernel_dir + "/" + file_name);
+		return;
+	}
+
+#ifdef HAVE_EMBEDDED_KERNEL_SOURCES
+	for (const EmbeddedKernelSource& embedded : embedded_kernel_sources) {
+		if (strcmp(embedded.file_name, file_name.c_str()) == 0) {
+			sources.push_back(embedded.source);
+			return;
+		}
+	}
+#endif
+
+	AddSources(sources, file_name);
+}
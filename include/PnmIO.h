@@ -0,0 +1,549 @@
+#pragma once
+
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <future>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Utils.h"
+
+//PNM (PGM/PPM, and PAM for images with alpha) input without going through CImg's stdio parser
+//binary P5/P6 files are memory-mapped and the pixel payload is used straight from the page cache,
+//so loading costs one pass over the data (a copy for P5, a deinterleave into planar layout for P6).
+//ascii P2/P3 bodies are tokenised and parsed by several threads, each into its own part of the output.
+//output goes the other way: the payload is written from where it already is with large positional writes.
+
+//read-only, move-only memory mapping of a whole file
+class MappedFile {
+public:
+	MappedFile() : data(nullptr), size(0) {
+#ifdef _WIN32
+		file = INVALID_HANDLE_VALUE;
+		mapping = NULL;
+#endif
+	}
+
+	MappedFile(MappedFile&& other) : MappedFile() {
+		*this = move(other);
+	}
+
+	MappedFile& operator=(MappedFile&& other) {
+		if (this != &other) {
+			Close();
+			data = other.data;
+			size = other.size;
+			other.data = nullptr;
+			other.size = 0;
+#ifdef _WIN32
+			file = other.file;
+			mapping = other.mapping;
+			other.file = INVALID_HANDLE_VALUE;
+			other.mapping = NULL;
+#endif
+		}
+		return *this;
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile() {
+		Close();
+	}
+
+	//maps the file, returns false if it can not be opened or is empty
+	bool Open(const string& file_name) {
+		Close();
+#ifdef _WIN32
+		file = CreateFileA(file_name.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER file_size;
+		if (!GetFileSizeEx(file, &file_size) || file_size.QuadPart == 0) {
+			Close();
+			return false;
+		}
+		mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (mapping == NULL) {
+			Close();
+			return false;
+		}
+		data = (const unsigned char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+		if (!data) {
+			Close();
+			return false;
+		}
+		size = (size_t)file_size.QuadPart;
+#else
+		int fd = open(file_name.c_str(), O_RDONLY);
+		if (fd < 0)
+			return false;
+		struct stat file_stat;
+		if (fstat(fd, &file_stat) != 0 || file_stat.st_size == 0) {
+			close(fd);
+			return false;
+		}
+		void* mapped = mmap(nullptr, (size_t)file_stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		//the mapping keeps its own reference to the file
+		close(fd);
+		if (mapped == MAP_FAILED)
+			return false;
+		//the payload is read front to back once, so the kernel can read ahead aggressively
+		madvise(mapped, (size_t)file_stat.st_size, MADV_SEQUENTIAL);
+		data = (const unsigned char*)mapped;
+		size = (size_t)file_stat.st_size;
+#endif
+		return true;
+	}
+
+	void Close() {
+#ifdef _WIN32
+		if (data)
+			UnmapViewOfFile(data);
+		if (mapping != NULL)
+			CloseHandle(mapping);
+		if (file != INVALID_HANDLE_VALUE)
+			CloseHandle(file);
+		mapping = NULL;
+		file = INVALID_HANDLE_VALUE;
+#else
+		if (data)
+			munmap((void*)data, size);
+#endif
+		data = nullptr;
+		size = 0;
+	}
+
+	const unsigned char* Data() const { return data; }
+	size_t Size() const { return size; }
+
+private:
+	const unsigned char* data;
+	size_t size;
+#ifdef _WIN32
+	HANDLE file;
+	HANDLE mapping;
+#endif
+};
+
+struct PnmHeader {
+	char format = 0; //'2', '3', '5', '6' or '7' (PAM) from the magic number
+	int width = 0;
+	int height = 0;
+	int max_value = 0;
+	int spectrum = 0; //1 for PGM, 3 for PPM, the DEPTH of a PAM (e.g. 4 for RGB_ALPHA)
+	size_t header_size = 0; //offset of the pixel data
+
+	bool IsBinary() const { return format == '5' || format == '6' || format == '7'; }
+};
+
+//parses the WIDTH/HEIGHT/DEPTH/MAXVAL lines of a PAM (P7) header up to ENDHDR, the tuple type is not needed
+//since the channel count comes from DEPTH (images with 2 or 4 channels are taken to end in alpha)
+bool ParsePamHeader(const unsigned char* data, size_t size, PnmHeader& header) {
+	size_t pos = 2;
+	while (pos < size) {
+		size_t end = pos;
+		while (end < size && data[end] != '\n')
+			end++;
+		if (end == size)
+			return false;
+		stringstream tokens(string((const char*)data + pos, end - pos));
+		pos = end + 1;
+
+		string key;
+		tokens >> key;
+		if (key == "ENDHDR") {
+			header.header_size = pos;
+			return header.width > 0 && header.height > 0 && header.spectrum > 0 && header.spectrum <= 4 && header.max_value > 0;
+		}
+		else if (key == "WIDTH")
+			tokens >> header.width;
+		else if (key == "HEIGHT")
+			tokens >> header.height;
+		else if (key == "DEPTH")
+			tokens >> header.spectrum;
+		else if (key == "MAXVAL")
+			tokens >> header.max_value;
+	}
+	return false;
+}
+
+//parses the magic number, width, height and maximum value of a P2/P3/P5/P6 header, skipping comments
+//header_size points just past the single whitespace character that ends the header
+bool ParsePnmHeader(const unsigned char* data, size_t size, PnmHeader& header) {
+	if (size < 2 || data[0] != 'P' || data[1] == 0 || !strchr("23567", data[1]))
+		return false;
+	header.format = (char)data[1];
+	if (header.format == '7')
+		return ParsePamHeader(data, size, header);
+	header.spectrum = (header.format == '3' || header.format == '6') ? 3 : 1;
+
+	size_t pos = 2;
+	int values[3];
+	for (int i = 0; i < 3; i++) {
+		//whitespace and comment lines may separate the fields
+		while (pos < size && (isspace(data[pos]) || data[pos] == '#')) {
+			if (data[pos] == '#')
+				while (pos < size && data[pos] != '\n')
+					pos++;
+			else
+				pos++;
+		}
+		if (pos >= size || !isdigit(data[pos]))
+			return false;
+		long long value = 0;
+		while (pos < size && isdigit(data[pos]) && value <= numeric_limits<int>::max())
+			value = value * 10 + (data[pos++] - '0');
+		if (value <= 0 || value > numeric_limits<int>::max())
+			return false;
+		values[i] = (int)value;
+	}
+	if (pos >= size || !isspace(data[pos]))
+		return false;
+
+	header.width = values[0];
+	header.height = values[1];
+	header.max_value = values[2];
+	header.header_size = pos + 1;
+	return true;
+}
+
+//reads the dimensions from a binary or ascii PNM header, returns false for any other format
+//(including PAM, since CImg's load_pnm reads P7 as its own 3D extension)
+bool ReadPnmSize(const string& file_name, int& width, int& height, int& spectrum) {
+	ifstream file(file_name, ios::binary);
+	char buffer[1024];
+	file.read(buffer, sizeof(buffer));
+
+	PnmHeader header;
+	if (!ParsePnmHeader((const unsigned char*)buffer, (size_t)file.gcount(), header) || header.format == '7')
+		return false;
+
+	width = header.width;
+	height = header.height;
+	spectrum = header.spectrum;
+	return true;
+}
+
+//interleaved (RGBRGB...) to planar (RR..GG..BB..) for pixels [first, first + count) of an image with
+//pixel_count pixels, so a large image can also be converted in chunks as it streams in
+void DeinterleaveToPlanar(const unsigned char* interleaved, unsigned char* planar, size_t pixel_count, int spectrum,
+	size_t first = 0, size_t count = numeric_limits<size_t>::max()) {
+	size_t last = min(pixel_count, first + min(count, pixel_count - first));
+	if (spectrum == 3) {
+		unsigned char* r = planar;
+		unsigned char* g = planar + pixel_count;
+		unsigned char* b = planar + 2 * pixel_count;
+		for (size_t i = first; i < last; i++) {
+			r[i] = interleaved[3 * i];
+			g[i] = interleaved[3 * i + 1];
+			b[i] = interleaved[3 * i + 2];
+		}
+	}
+	else {
+		for (size_t i = first; i < last; i++)
+			for (int c = 0; c < spectrum; c++)
+				planar[c * pixel_count + i] = interleaved[i * spectrum + c];
+	}
+}
+
+//planar to interleaved, the inverse of DeinterleaveToPlanar
+void InterleaveFromPlanar(const unsigned char* planar, unsigned char* interleaved, size_t pixel_count, int spectrum) {
+	for (size_t i = 0; i < pixel_count; i++)
+		for (int c = 0; c < spectrum; c++)
+			interleaved[i * spectrum + c] = planar[c * pixel_count + i];
+}
+
+//whitespace as scanf sees it in the C locale
+inline bool IsPnmSpace(unsigned char c) {
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t' || c == '\v' || c == '\f';
+}
+
+//number of whitespace-separated tokens in [begin, end)
+size_t CountPnmTokens(const unsigned char* begin, const unsigned char* end) {
+	size_t count = 0;
+	bool in_token = false;
+	for (const unsigned char* c = begin; c < end; c++) {
+		bool space = IsPnmSpace(*c);
+		if (!space && !in_token)
+			count++;
+		in_token = !space;
+	}
+	return count;
+}
+
+//parses the tokens in [begin, end) as the samples first, first + 1, ... of an image with pixel_count pixels,
+//into planar or interleaved output; samples past the end of the image are ignored.
+//values are converted like CImg's "%d" loop does, i.e. cast to 8 bits without scaling by the maximum value.
+//returns false for anything that is not a (signed) decimal number.
+bool ParsePnmTokens(const unsigned char* begin, const unsigned char* end, size_t first, unsigned char* output,
+	size_t pixel_count, int spectrum, bool planar) {
+	size_t sample_count = pixel_count * spectrum;
+	size_t sample = first;
+	const unsigned char* c = begin;
+	while (c < end) {
+		while (c < end && IsPnmSpace(*c))
+			c++;
+		if (c == end)
+			break;
+		bool negative = *c == '-';
+		if (*c == '-' || *c == '+')
+			c++;
+		if (c == end || !isdigit(*c))
+			return false;
+		//only the low 8 bits are kept, so the accumulator may wrap
+		unsigned int value = 0;
+		while (c < end && isdigit(*c))
+			value = value * 10 + (*c++ - '0');
+		if (c < end && !IsPnmSpace(*c))
+			return false;
+		if (negative)
+			value = 0u - value;
+
+		if (sample < sample_count) {
+			if (planar)
+				output[(sample % spectrum) * pixel_count + sample / spectrum] = (unsigned char)value;
+			else
+				output[sample] = (unsigned char)value;
+		}
+		sample++;
+	}
+	return true;
+}
+
+//parses the body of an ascii PGM (P2) or PPM (P3) into planar or interleaved output of pixel_count * spectrum bytes
+//the body is split into one chunk per worker at whitespace, the tokens of every chunk are counted in parallel,
+//a prefix sum of the counts gives each chunk the index of its first sample, and the chunks are then parsed in parallel.
+//returns false if the body is malformed or too short, callers then fall back to CImg, which gives the same pixels.
+bool ParseAsciiPnm(const unsigned char* body, size_t body_size, unsigned char* output, size_t pixel_count, int spectrum, bool planar) {
+	//chunks of at least 64 kB, so small images are parsed on the calling thread
+	size_t workers = max((size_t)1, min((size_t)min(thread::hardware_concurrency(), 8u), body_size / (64 * 1024)));
+	vector<const unsigned char*> bounds(workers + 1);
+	bounds[0] = body;
+	bounds[workers] = body + body_size;
+	for (size_t i = 1; i < workers; i++) {
+		//a chunk ends on whitespace, so no token straddles two chunks
+		const unsigned char* bound = max(bounds[i - 1], body + i * (body_size / workers));
+		while (bound < bounds[workers] && !IsPnmSpace(*bound))
+			bound++;
+		bounds[i] = bound;
+	}
+
+	vector<future<size_t>> counters;
+	for (size_t i = 0; i < workers; i++)
+		counters.push_back(async(workers > 1 ? launch::async : launch::deferred, CountPnmTokens, bounds[i], bounds[i + 1]));
+	vector<size_t> firsts(workers + 1, 0);
+	for (size_t i = 0; i < workers; i++)
+		firsts[i + 1] = firsts[i] + counters[i].get();
+	if (firsts[workers] < pixel_count * spectrum)
+		return false;
+
+	vector<future<bool>> parsers;
+	for (size_t i = 0; i < workers; i++)
+		parsers.push_back(async(workers > 1 ? launch::async : launch::deferred, ParsePnmTokens, bounds[i], bounds[i + 1], firsts[i], output,
+			pixel_count, spectrum, planar));
+	bool success = true;
+	for (size_t i = 0; i < workers; i++)
+		success = parsers[i].get() && success;
+	return success;
+}
+
+//a memory-mapped PGM (P5/P2), PPM (P6/P3) or PAM (P7) with 8-bit samples, or one already read into memory
+//for binary files Pixels() is a zero-copy view of the interleaved payload inside the mapping
+class MappedPnm {
+public:
+	MappedPnm() : data(nullptr), size(0) {}
+
+	//false when the file is not an 8-bit PNM (or a binary one is truncated), callers then fall back to a general loader
+	bool Open(const string& file_name) {
+		if (!file.Open(file_name))
+			return false;
+		if (!Open(file.Data(), file.Size())) {
+			file.Close();
+			return false;
+		}
+		return true;
+	}
+
+	//the same for a file read by the caller, whose memory must outlive this object's use
+	bool Open(const unsigned char* file_data, size_t file_size) {
+		data = file_data;
+		size = file_size;
+		if (!ParsePnmHeader(data, size, header) || header.max_value > 255 || (header.IsBinary() && size - header.header_size < PixelBytes())) {
+			data = nullptr;
+			size = 0;
+			return false;
+		}
+		return true;
+	}
+
+	const PnmHeader& Header() const { return header; }
+	int Width() const { return header.width; }
+	int Height() const { return header.height; }
+	int Spectrum() const { return header.spectrum; }
+	size_t PixelBytes() const { return (size_t)header.width * header.height * header.spectrum; }
+
+	const unsigned char* Pixels() const { return data + header.header_size; }
+
+	//copies the pixels in the order they are stored, for the interleaved kernels
+	//false if an ascii body is malformed
+	bool ReadInterleaved(unsigned char* interleaved) const {
+		if (!header.IsBinary())
+			return ParseAsciiPnm(Pixels(), size - header.header_size, interleaved, (size_t)header.width * header.height, header.spectrum, false);
+		memcpy(interleaved, Pixels(), PixelBytes());
+		return true;
+	}
+
+	//copies the image into planar memory of PixelBytes() bytes, converting rows in parallel for colour images
+	//false if an ascii body is malformed
+	bool ReadPlanar(unsigned char* planar) const {
+		size_t pixel_count = (size_t)header.width * header.height;
+		if (!header.IsBinary())
+			return ParseAsciiPnm(Pixels(), size - header.header_size, planar, pixel_count, header.spectrum, true);
+		if (header.spectrum == 1) {
+			memcpy(planar, Pixels(), pixel_count);
+			return true;
+		}
+
+		unsigned int workers = max(1u, min(thread::hardware_concurrency(), 8u));
+		size_t chunk = (pixel_count + workers - 1) / workers;
+		vector<future<void>> chunks;
+		for (unsigned int i = 0; i < workers && i * chunk < pixel_count; i++)
+			chunks.push_back(async(launch::async, DeinterleaveToPlanar, Pixels(), planar, pixel_count, header.spectrum, i * chunk, chunk));
+		for (unsigned int i = 0; i < chunks.size(); i++)
+			chunks[i].get();
+		return true;
+	}
+
+private:
+	MappedFile file;
+	const unsigned char* data;
+	size_t size;
+	PnmHeader header;
+};
+
+#ifndef _WIN32
+//writes all of data at offset, retrying short and interrupted writes
+bool WriteAt(int fd, const unsigned char* data, size_t size, size_t offset) {
+	while (size > 0) {
+		ssize_t written = pwrite(fd, data, size, (off_t)offset);
+		if (written < 0 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		data += written;
+		size -= (size_t)written;
+		offset += (size_t)written;
+	}
+	return true;
+}
+#endif
+
+//the header of an 8-bit binary PGM (P5) or PPM (P6), or of a PAM (P7) for grey or RGB with alpha,
+//empty for other channel counts
+string PnmHeaderText(int width, int height, int spectrum) {
+	stringstream sstream;
+	if (spectrum == 1 || spectrum == 3)
+		sstream << (spectrum == 1 ? "P5" : "P6") << "\n" << width << " " << height << "\n255\n";
+	else if (spectrum == 2 || spectrum == 4)
+		sstream << "P7\nWIDTH " << width << "\nHEIGHT " << height << "\nDEPTH " << spectrum << "\nMAXVAL 255\nTUPLTYPE "
+			<< (spectrum == 2 ? "GRAYSCALE_ALPHA" : "RGB_ALPHA") << "\nENDHDR\n";
+	return sstream.str();
+}
+
+//writes an interleaved 8-bit image as a binary PGM/PPM/PAM straight from pixels (e.g. mapped staging memory), without
+//an intermediate copy. the payload is split into chunks that are written concurrently at their file offsets, with
+//positional writes (pwrite) on POSIX and overlapped WriteFile calls on Windows.
+//returns false when the file can not be written or the image has more than 4 channels.
+bool WritePnm(const string& file_name, const unsigned char* pixels, int width, int height, int spectrum, unsigned int chunks = 1) {
+	string header = PnmHeaderText(width, height, spectrum);
+	if (header.empty())
+		return false;
+	size_t payload_size = (size_t)width * height * spectrum;
+	//chunks of at least 64 kB, so a large chunk count can not turn into a write (and thread) per few bytes
+	chunks = (unsigned int)max((size_t)1, min((size_t)chunks, payload_size / (64 * 1024)));
+	size_t chunk_size = (payload_size + chunks - 1) / chunks;
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(file_name.c_str(), GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_OVERLAPPED, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	//every write is issued before waiting for any, a single WriteFile moves at most 1 GB
+	const size_t max_write = (size_t)1 << 30;
+	vector<const unsigned char*> sources;
+	vector<DWORD> sizes;
+	vector<size_t> offsets;
+	sources.push_back((const unsigned char*)header.data());
+	sizes.push_back((DWORD)header.size());
+	offsets.push_back(0);
+	for (size_t first = 0; first < payload_size; first += chunk_size) {
+		size_t last = min(payload_size, first + chunk_size);
+		for (size_t i = first; i < last; i += max_write) {
+			sources.push_back(pixels + i);
+			sizes.push_back((DWORD)min(max_write, last - i));
+			offsets.push_back(header.size() + i);
+		}
+	}
+
+	vector<OVERLAPPED> requests(sources.size());
+	bool success = true;
+	size_t issued = 0;
+	for (; issued < requests.size(); issued++) {
+		OVERLAPPED& request = requests[issued];
+		memset(&request, 0, sizeof(request));
+		request.Offset = (DWORD)(offsets[issued] & 0xFFFFFFFF);
+		request.OffsetHigh = (DWORD)((unsigned long long)offsets[issued] >> 32);
+		request.hEvent = CreateEventA(NULL, TRUE, FALSE, NULL);
+		if (request.hEvent == NULL || (!WriteFile(file, sources[issued], sizes[issued], NULL, &request) && GetLastError() != ERROR_IO_PENDING)) {
+			if (request.hEvent != NULL)
+				CloseHandle(request.hEvent);
+			success = false;
+			break;
+		}
+	}
+	for (size_t i = 0; i < issued; i++) {
+		DWORD written = 0;
+		if (!GetOverlappedResult(file, &requests[i], &written, TRUE) || written != sizes[i])
+			success = false;
+		CloseHandle(requests[i].hEvent);
+	}
+	CloseHandle(file);
+	return success;
+#else
+	int fd = open(file_name.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	//sizing the file up front lets the chunks be written in any order without extending it
+	bool success = ftruncate(fd, (off_t)(header.size() + payload_size)) == 0 && WriteAt(fd, (const unsigned char*)header.data(), header.size(), 0);
+
+	vector<future<bool>> writers;
+	for (size_t first = 0; success && first < payload_size; first += chunk_size)
+		writers.push_back(async(chunks > 1 ? launch::async : launch::deferred, WriteAt, fd, pixels + first, min(chunk_size, payload_size - first), header.size() + first));
+	for (unsigned int i = 0; i < writers.size(); i++)
+		success = writers[i].get() && success;
+
+	return close(fd) == 0 && success;
+#endif
+}
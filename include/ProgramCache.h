@@ -0,0 +1,228 @@
+#pragma once
+
+#include <cstdio>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "Utils.h"
+
+//on-disk cache of program binaries (CL_PROGRAM_BINARIES)
+//each entry is keyed by a hash of the platform/device/driver versions, the kernel source and the build options,
+//so a driver update or a kernel edit simply produces a new key instead of loading a stale binary.
+//entries are written to a unique temporary file and renamed into place, so concurrent processes
+//never observe a partially written file; corrupt or rejected entries fall back to a source build.
+
+const char PROGRAM_CACHE_MAGIC[8] = { 'C', 'L', 'B', 'I', 'N', '0', '0', '1' };
+
+//result of the last BuildProgramCached call, used for reporting
+struct ProgramCacheStats {
+	bool hit = false;
+	double build_ms = 0.0;
+	string key;
+};
+
+//64-bit FNV-1a, chained through the seed so several strings can be hashed into one key
+unsigned long long HashFNV1a(const void* data, size_t size, unsigned long long hash = 14695981039346656037ULL) {
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
+}
+
+unsigned long long HashFNV1a(const string& data, unsigned long long hash = 14695981039346656037ULL) {
+	//include the length so that ("ab","c") and ("a","bc") give different keys
+	unsigned long long size = data.size();
+	hash = HashFNV1a(&size, sizeof(size), hash);
+	return HashFNV1a(data.data(), data.size(), hash);
+}
+
+string ProgramCacheKey(const cl::Device& device, const cl::Program::Sources& sources, const string& options) {
+	const DeviceInfo* info = DeviceRegistry::Get().Find(device);
+	unsigned long long hash;
+
+	if (info) {
+		const PlatformInfo& platform = DeviceRegistry::Get().Platform(info->platform_id);
+		hash = HashFNV1a(platform.name);
+		hash = HashFNV1a(platform.version, hash);
+		hash = HashFNV1a(info->name, hash);
+		hash = HashFNV1a(info->version, hash);
+		hash = HashFNV1a(info->driver_version, hash);
+	}
+	else {
+		cl::Platform platform(device.getInfo<CL_DEVICE_PLATFORM>());
+		hash = HashFNV1a(platform.getInfo<CL_PLATFORM_NAME>());
+		hash = HashFNV1a(platform.getInfo<CL_PLATFORM_VERSION>(), hash);
+		hash = HashFNV1a(device.getInfo<CL_DEVICE_NAME>(), hash);
+		hash = HashFNV1a(device.getInfo<CL_DEVICE_VERSION>(), hash);
+		hash = HashFNV1a(device.getInfo<CL_DRIVER_VERSION>(), hash);
+	}
+	hash = HashFNV1a(options, hash);
+	for (unsigned int i = 0; i < sources.size(); i++)
+		hash = HashFNV1a(sources[i], hash);
+
+	stringstream sstream;
+	sstream << hex << setw(16) << setfill('0') << hash;
+	return sstream.str();
+}
+
+void MakeDirectory(const string& path) {
+	//an already existing directory is not an error
+#ifdef _WIN32
+	_mkdir(path.c_str());
+#else
+	mkdir(path.c_str(), 0755);
+#endif
+}
+
+//reads a cache entry, returns false if it is missing, truncated or does not match the key
+bool ReadProgramBinary(const string& file_name, const string& key, vector<unsigned char>& binary) {
+	ifstream file(file_name, ios::binary);
+	if (!file)
+		return false;
+
+	char magic[sizeof(PROGRAM_CACHE_MAGIC)];
+	unsigned long long stored_hash = 0, size = 0;
+	string stored_key(key.size(), '\0');
+
+	file.read(magic, sizeof(magic));
+	file.read(&stored_key[0], stored_key.size());
+	file.read((char*)&size, sizeof(size));
+	file.read((char*)&stored_hash, sizeof(stored_hash));
+	if (!file || memcmp(magic, PROGRAM_CACHE_MAGIC, sizeof(magic)) != 0 || stored_key != key || size == 0)
+		return false;
+
+	binary.resize((size_t)size);
+	file.read((char*)binary.data(), binary.size());
+	if (!file || (unsigned long long)file.gcount() != size)
+		return false;
+
+	return HashFNV1a(binary.data(), binary.size()) == stored_hash;
+}
+
+//writes a cache entry atomically: unique temporary file first, then rename over the final name
+void WriteProgramBinary(const string& file_name, const string& key, const vector<unsigned char>& binary) {
+	random_device rd;
+	stringstream tmp_name;
+#ifdef _WIN32
+	tmp_name << file_name << "." << _getpid() << "." << rd() << ".tmp";
+#else
+	tmp_name << file_name << "." << getpid() << "." << rd() << ".tmp";
+#endif
+
+	{
+		ofstream file(tmp_name.str(), ios::binary | ios::trunc);
+		if (!file)
+			return;
+
+		unsigned long long size = binary.size();
+		unsigned long long hash = HashFNV1a(binary.data(), binary.size());
+		file.write(PROGRAM_CACHE_MAGIC, sizeof(PROGRAM_CACHE_MAGIC));
+		file.write(key.data(), key.size());
+		file.write((const char*)&size, sizeof(size));
+		file.write((const char*)&hash, sizeof(hash));
+		file.write((const char*)binary.data(), binary.size());
+		if (!file) {
+			file.close();
+			remove(tmp_name.str().c_str());
+			return;
+		}
+	}
+
+	//rename is atomic on POSIX; on Windows it fails when the target exists,
+	//in which case another process has already stored the same entry (or a stale one we replace)
+	if (rename(tmp_name.str().c_str(), file_name.c_str()) != 0) {
+		remove(file_name.c_str());
+		if (rename(tmp_name.str().c_str(), file_name.c_str()) != 0)
+			remove(tmp_name.str().c_str());
+	}
+}
+
+void PrintBuildLog(const cl::Program& program, const cl::Device& device) {
+	std::cout << "Build Status: " << program.getBuildInfo<CL_PROGRAM_BUILD_STATUS>(device) << std::endl;
+	std::cout << "Build Options:\t" << program.getBuildInfo<CL_PROGRAM_BUILD_OPTIONS>(device) << std::endl;
+	std::cout << "Build Log:\t " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+}
+
+//builds a program for all devices in the context, loading binaries from cache_dir when possible
+//an empty cache_dir disables the cache
+cl::Program BuildProgramCached(const cl::Context& context, const cl::Program::Sources& sources, const string& options = "",
+	const string& cache_dir = "kernel_cache", ProgramCacheStats* stats = nullptr) {
+	auto start = chrono::steady_clock::now();
+
+	vector<cl::Device> devices = context.getInfo<CL_CONTEXT_DEVICES>();
+	vector<string> keys, file_names;
+	cl::Program::Binaries binaries;
+	bool hit = !cache_dir.empty();
+
+	if (!cache_dir.empty()) {
+		for (unsigned int i = 0; i < devices.size(); i++) {
+			keys.push_back(ProgramCacheKey(devices[i], sources, options));
+			file_names.push_back(cache_dir + "/" + keys[i] + ".clbin");
+
+			vector<unsigned char> binary;
+			if (hit && ReadProgramBinary(file_names[i], keys[i], binary))
+				binaries.push_back(binary);
+			else
+				hit = false;
+		}
+	}
+
+	cl::Program program;
+
+	//warm path: binaries for every device were found on disk
+	if (hit) {
+		try {
+			program = cl::Program(context, devices, binaries);
+			program.build(devices, options.c_str());
+		}
+		catch (const cl::Error&) {
+			//the runtime rejected the binary (e.g. a driver change not reflected in the version strings)
+			hit = false;
+		}
+	}
+
+	//cold path: build from source and store the binaries for the next run
+	if (!hit) {
+		program = cl::Program(context, sources);
+		try {
+			program.build(devices, options.c_str());
+		}
+		catch (const cl::Error& err) {
+			PrintBuildLog(program, devices[0]);
+			throw err;
+		}
+
+		if (!cache_dir.empty()) {
+			MakeDirectory(cache_dir);
+			binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+			for (unsigned int i = 0; i < binaries.size() && i < file_names.size(); i++) {
+				if (!binaries[i].empty())
+					WriteProgramBinary(file_names[i], keys[i], binaries[i]);
+			}
+		}
+	}
+
+	if (stats) {
+		stats->hit = hit;
+		stats->build_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+		stats->key = keys.empty() ? "" : keys[0];
+	}
+
+	return program;
+}
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <chrono>
+#include <future>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+
+#include "Utils.h"
+#include "ProgramCache.h"
+#include "KernelSources.h"
+#include "KernelCache.h"
+
+//a set of separately compiled program units (one per pipeline), each built lazily on first use
+//so that build time scales with the kernels that are actually needed.
+//a unit can be prefetched to build it in the background, Get() then only waits for it.
+class ProgramLibrary {
+public:
+	//kernel_dir overrides the embedded kernel sources with the files in that directory
+	ProgramLibrary(const cl::Context& context, const string& cache_dir = "kernel_cache", const string& kernel_dir = "")
+		: context(context), cache_dir(cache_dir), kernel_dir(kernel_dir) {
+	}
+
+	//registers a program unit, nothing is loaded or compiled until the unit is requested
+	void Register(const string& unit_name, const string& file_name, const string& options = "") {
+		lock_guard<mutex> lock(units_mutex);
+		Unit& unit = units[unit_name];
+		unit.file_name = file_name;
+		unit.options = options;
+	}
+
+	//starts building a unit on a host thread
+	void Prefetch(const string& unit_name) {
+		lock_guard<mutex> lock(units_mutex);
+		StartBuild(unit_name);
+	}
+
+	//returns the built program for a unit, compiling it now if it was not prefetched
+	cl::Program Get(const string& unit_name) {
+		shared_future<cl::Program> build;
+		{
+			lock_guard<mutex> lock(units_mutex);
+			build = StartBuild(unit_name);
+		}
+
+		auto wait_start = chrono::steady_clock::now();
+		cl::Program program = build.get();
+		double wait_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - wait_start).count();
+
+		lock_guard<mutex> lock(units_mutex);
+		units[unit_name].wait_ms += wait_ms;
+		return program;
+	}
+
+	//a pre-created kernel of a unit for the calling thread, with memoized arguments (see KernelCache)
+	BoundKernel& Kernel(const string& unit_name, const string& kernel_name) {
+		return kernels.Get(Get(unit_name), kernel_name);
+	}
+
+	//to be called once the buffers bound to the kernels may be released, e.g. after every image
+	void ForgetKernelArguments() {
+		kernels.ForgetArguments();
+	}
+
+	//compile cost of every unit, units that were never requested are listed as not built
+	string Report() {
+		lock_guard<mutex> lock(units_mutex);
+		stringstream sstream;
+
+		for (auto& entry : units) {
+			const Unit& unit = entry.second;
+			sstream << "Program unit " << entry.first << " (" << unit.file_name << "): ";
+			if (!unit.build.valid()) {
+				sstream << "not built" << endl;
+				continue;
+			}
+			if (unit.build.wait_for(chrono::seconds(0)) != future_status::ready) {
+				sstream << "building" << endl;
+				continue;
+			}
+			sstream << "build [ms]: " << unit.stats.build_ms << (unit.stats.hit ? " (cached binary)" : " (from source)");
+			sstream << ", waited [ms]: " << unit.wait_ms << endl;
+		}
+		sstream << kernels.Report();
+
+		return sstream.str();
+	}
+
+private:
+	struct Unit {
+		string file_name;
+		string options;
+		shared_future<cl::Program> build;
+		ProgramCacheStats stats;
+		double wait_ms = 0.0;
+	};
+
+	//must be called with units_mutex held
+	shared_future<cl::Program> StartBuild(const string& unit_name) {
+		auto found = units.find(unit_name);
+		if (found == units.end())
+			throw cl::Error(CL_INVALID_PROGRAM, "ProgramLibrary: unknown program unit");
+
+		Unit& unit = found->second;
+		if (!unit.build.valid()) {
+			//map nodes are never erased, so the unit (and its stats) outlive the build thread
+			Unit* target = &unit;
+			cl::Context build_context = context;
+			string build_cache_dir = cache_dir, build_kernel_dir = kernel_dir;
+			unit.build = async(launch::async, [target, unit_name, build_context, build_cache_dir, build_kernel_dir]() {
+				cl::Program::Sources sources;
+				AddKernelSources(sources, target->file_name, build_kernel_dir);
+				cl::Program program = BuildProgramCached(build_context, sources, target->options, build_cache_dir, &target->stats);
+				GetStartupProfile().Record("program build (" + unit_name + ")", target->stats.build_ms);
+				return program;
+			}).share();
+		}
+
+		return unit.build;
+	}
+
+	cl::Context context;
+	string cache_dir;
+	string kernel_dir;
+	map<string, Unit> units;
+	mutex units_mutex;
+	KernelCache kernels;
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <chrono>
+#include <cstring>
+#include <sstream>
+#include <vector>
+
+#include "Utils.h"
+#include "HostMemory.h"
+
+//pinned host staging memory for asynchronous transfers
+//a CL_MEM_ALLOC_HOST_PTR buffer is allocated by the runtime in page-locked memory and mapped once for its lifetime,
+//so non-blocking reads and writes through the mapped pointer are direct DMA transfers; from pageable memory
+//most drivers either block or copy into an internal pinned buffer first.
+//the runtime chooses where the memory lives; with a NUMA policy the mapped pages are moved to the policy's node where
+//possible (see PlacePages), which CPU runtimes allow but pages a GPU driver has pinned stay where the driver put them.
+//huge pages are not applied to staging memory.
+class StagingBuffer {
+public:
+	StagingBuffer() : data(nullptr), size(0) {}
+
+	explicit StagingBuffer(const HostMemoryPolicy& policy) : StagingBuffer() {
+		this->policy = policy;
+	}
+
+	StagingBuffer(const cl::Context& context, const cl::CommandQueue& queue, size_t size) : StagingBuffer() {
+		Reserve(context, queue, size);
+	}
+
+	StagingBuffer(StagingBuffer&& other) : StagingBuffer() {
+		*this = move(other);
+	}
+
+	StagingBuffer& operator=(StagingBuffer&& other) {
+		if (this != &other) {
+			Unmap();
+			queue = other.queue;
+			buffer = other.buffer;
+			data = other.data;
+			size = other.size;
+			policy = other.policy;
+			other.queue = cl::CommandQueue();
+			other.buffer = cl::Buffer();
+			other.data = nullptr;
+			other.size = 0;
+		}
+		return *this;
+	}
+
+	StagingBuffer(const StagingBuffer&) = delete;
+	StagingBuffer& operator=(const StagingBuffer&) = delete;
+
+	~StagingBuffer() {
+		try {
+			Unmap();
+		}
+		catch (const cl::Error&) {
+			//nothing sensible to do when the runtime fails during teardown
+		}
+	}
+
+	//makes sure at least size bytes are available, growing (and remapping) the buffer when needed
+	//the contents are not preserved when the buffer grows
+	void Reserve(const cl::Context& context, const cl::CommandQueue& queue, size_t size) {
+		if (data && size <= this->size)
+			return;
+
+		Unmap();
+		this->queue = queue;
+		buffer = cl::Buffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, size);
+		data = (unsigned char*)this->queue.enqueueMapBuffer(buffer, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, size);
+		this->size = size;
+		PlacePages(data, size, policy, true);
+	}
+
+	unsigned char* Data() const { return data; }
+	size_t Size() const { return size; }
+
+private:
+	void Unmap() {
+		if (data) {
+			queue.enqueueUnmapMemObject(buffer, data);
+			queue.finish();
+		}
+		data = nullptr;
+		size = 0;
+		buffer = cl::Buffer();
+	}
+
+	cl::CommandQueue queue;
+	cl::Buffer buffer;
+	unsigned char* data;
+	size_t size;
+	HostMemoryPolicy policy;
+};
+
+//throughput in MB/s of size bytes moved in ms milliseconds
+double TransferRate(size_t size, double ms) {
+	return ms > 0.0 ? (size / (1024.0 * 1024.0)) / (ms / 1000.0) : 0.0;
+}
+
+//host-timed upload and download throughput of pageable (std::vector) against pinned (staging) host memory
+//each direction is repeated and only timed once the transfer has completed, so driver-side staging copies are included
+string TransferBenchmark(const cl::Context& context, cl::CommandQueue& queue, size_t size, int repeats = 10) {
+	cl::Buffer device_buffer(context, CL_MEM_READ_WRITE, size);
+	vector<unsigned char> pageable(size, 1);
+	StagingBuffer pinned(context, queue, size);
+	memset(pinned.Data(), 1, size);
+
+	double pageable_upload = 0.0, pageable_download = 0.0, pinned_upload = 0.0, pinned_download = 0.0;
+	for (int i = 0; i < repeats; i++) {
+		auto start = chrono::steady_clock::now();
+		queue.enqueueWriteBuffer(device_buffer, CL_FALSE, 0, size, pageable.data());
+		queue.finish();
+		pageable_upload += ElapsedMs(start);
+
+		start = chrono::steady_clock::now();
+		queue.enqueueReadBuffer(device_buffer, CL_FALSE, 0, size, pageable.data());
+		queue.finish();
+		pageable_download += ElapsedMs(start);
+
+		start = chrono::steady_clock::now();
+		queue.enqueueWriteBuffer(device_buffer, CL_FALSE, 0, size, pinned.Data());
+		queue.finish();
+		pinned_upload += ElapsedMs(start);
+
+		start = chrono::steady_clock::now();
+		queue.enqueueReadBuffer(device_buffer, CL_FALSE, 0, size, pinned.Data());
+		queue.finish();
+		pinned_download += ElapsedMs(start);
+	}
+
+	stringstream sstream;
+	sstream << "Transfer benchmark: " << size << " B x " << repeats << endl;
+	sstream << "   pageable upload [MB/s]: " << TransferRate(size * repeats, pageable_upload);
+	sstream << ", download [MB/s]: " << TransferRate(size * repeats, pageable_download) << endl;
+	sstream << "   pinned upload [MB/s]: " << TransferRate(size * repeats, pinned_upload);
+	sstream << ", download [MB/s]: " << TransferRate(size * repeats, pinned_download) << endl;
+	return sstream.str();
+}
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "Utils.h"
+
+//coarse-grained shared virtual memory (OpenCL 2.0), only available when built with ENABLE_SVM
+//the same pointer is valid on the host and in kernels, so no cl::Buffer or copy is involved;
+//with coarse-grained sharing the host may only touch the memory between Map() and Unmap(),
+//which act as the synchronisation points with the device.
+
+#ifdef ENABLE_SVM
+
+//true when a device can run the SVM pipeline
+bool SupportsCoarseGrainSvm(const DeviceInfo& device) {
+	return device.version_number >= 200 && (device.svm_capabilities & CL_DEVICE_SVM_COARSE_GRAIN_BUFFER);
+}
+
+//owning, move-only coarse-grained SVM allocation
+template <typename T>
+class SvmBuffer {
+public:
+	SvmBuffer() : data(nullptr), count(0) {}
+
+	SvmBuffer(const cl::Context& context, size_t count, cl_svm_mem_flags flags = CL_MEM_READ_WRITE)
+		: context(context), data(nullptr), count(count) {
+		data = (T*)clSVMAlloc(context(), flags, count * sizeof(T), 0);
+		if (!data)
+			throw cl::Error(CL_MEM_OBJECT_ALLOCATION_FAILURE, "SvmBuffer: clSVMAlloc failed");
+	}
+
+	SvmBuffer(SvmBuffer&& other) : SvmBuffer() {
+		*this = move(other);
+	}
+
+	SvmBuffer& operator=(SvmBuffer&& other) {
+		if (this != &other) {
+			Free();
+			context = other.context;
+			data = other.data;
+			count = other.count;
+			other.data = nullptr;
+			other.count = 0;
+		}
+		return *this;
+	}
+
+	SvmBuffer(const SvmBuffer&) = delete;
+	SvmBuffer& operator=(const SvmBuffer&) = delete;
+
+	~SvmBuffer() {
+		Free();
+	}
+
+	//the pointer passed to kernels (Kernel::setArg uses clSetKernelArgSVMPointer for it)
+	T* Get() const { return data; }
+	size_t Count() const { return count; }
+	size_t Bytes() const { return count * sizeof(T); }
+
+	//blocking map, the host may access the memory until Unmap()
+	T* Map(cl::CommandQueue& queue, cl_map_flags flags) {
+		queue.enqueueMapSVM(data, CL_TRUE, flags, Bytes());
+		return data;
+	}
+
+	void Unmap(cl::CommandQueue& queue) {
+		queue.enqueueUnmapSVM(data);
+	}
+
+private:
+	void Free() {
+		//kernels using the memory must have finished, callers finish the queue before releasing
+		if (data)
+			clSVMFree(context(), data);
+		data = nullptr;
+		count = 0;
+	}
+
+	cl::Context context;
+	T* data;
+	size_t count;
+};
+
+#endif
@@ -1,13 +1,25 @@
 #pragma once
 
+#include <cstdio>
 #include <fstream>
 #include <vector>
 #include <iostream>
 #include <sstream>
+#include <chrono>
+#include <future>
+#include <mutex>
 
 #define CL_USE_DEPRECATED_OPENCL_1_2_APIS
+//define ENABLE_SVM to build against the OpenCL 2.0 API, which adds the shared virtual memory pipeline
+//it is only used on devices reporting SVM support, the 1.2 buffer path remains the fallback
+#ifdef ENABLE_SVM
+//below 120 the bindings pick 1.x or 2.x entry points (e.g. for queue creation) from the platform version at run time
+#define CL_HPP_MINIMUM_OPENCL_VERSION 110
+#define CL_HPP_TARGET_OPENCL_VERSION 200
+#else
 #define CL_HPP_MINIMUM_OPENCL_VERSION 120
 #define CL_HPP_TARGET_OPENCL_VERSION 120
+#endif
 #define CL_HPP_ENABLE_EXCEPTIONS
 
 #include <CL/opencl.hpp>
@@ -24,18 +36,187 @@ ostream& operator<< (ostream& out, const vector<T>& v) {
 	return out;
 }
 
+//named durations of the startup phases (device enumeration, context creation, program builds, ...)
+class StartupProfile {
+public:
+	void Record(const string& phase, double ms) {
+		lock_guard<mutex> lock(phases_mutex);
+		phases.push_back(make_pair(phase, ms));
+	}
+
+	string Report() {
+		lock_guard<mutex> lock(phases_mutex);
+		stringstream sstream;
+		double total = 0.0;
+
+		sstream << "Startup time breakdown [ms]:" << endl;
+		for (unsigned int i = 0; i < phases.size(); i++) {
+			sstream << "   " << phases[i].first << ": " << phases[i].second << endl;
+			total += phases[i].second;
+		}
+		sstream << "   total: " << total << endl;
+
+		return sstream.str();
+	}
+
+private:
+	vector<pair<string, double>> phases;
+	mutex phases_mutex;
+};
+
+StartupProfile& GetStartupProfile() {
+	static StartupProfile profile;
+	return profile;
+}
+
+double ElapsedMs(const chrono::steady_clock::time_point& start) {
+	return chrono::duration<double, milli>(chrono::steady_clock::now() - start).count();
+}
+
+//device properties queried once during enumeration
+struct DeviceInfo {
+	cl::Device device;
+	int platform_id = 0;
+	string name;
+	string vendor;
+	string version;
+	string driver_version;
+	string opencl_c_version;
+	string extensions;
+	cl_device_type type = 0;
+	cl_uint compute_units = 0;
+	cl_uint clock_frequency = 0;
+	cl_uint mem_base_addr_align = 0; //in bits
+	cl_ulong local_mem_size = 0;
+	cl_ulong global_mem_size = 0;
+	cl_ulong max_mem_alloc_size = 0;
+	size_t max_work_group_size = 0;
+	bool host_unified_memory = false;
+	int version_number = 0; //e.g. 120 for "OpenCL 1.2"
+	cl_bitfield svm_capabilities = 0; //CL_DEVICE_SVM_CAPABILITIES, 0 below OpenCL 2.0 or without ENABLE_SVM
+
+	bool HasExtension(const string& extension) const {
+		return (" " + extensions + " ").find(" " + extension + " ") != string::npos;
+	}
+};
+
+struct PlatformInfo {
+	cl::Platform platform;
+	string name;
+	string vendor;
+	string version;
+	vector<DeviceInfo> devices;
+};
+
+//enumerates all platforms and devices once and serves every selection and naming query from the cache
+//platforms are queried concurrently, since each one is a separate ICD with its own startup cost
+class DeviceRegistry {
+public:
+	static DeviceRegistry& Get() {
+		static DeviceRegistry registry;
+		return registry;
+	}
+
+	const vector<PlatformInfo>& Platforms() const {
+		return platforms;
+	}
+
+	const PlatformInfo& Platform(int platform_id) const {
+		if ((platform_id < 0) || (platform_id >= (int)platforms.size()))
+			throw cl::Error(CL_INVALID_PLATFORM, "DeviceRegistry: invalid platform id");
+		return platforms[platform_id];
+	}
+
+	const DeviceInfo& Device(int platform_id, int device_id) const {
+		const PlatformInfo& platform = Platform(platform_id);
+		if ((device_id < 0) || (device_id >= (int)platform.devices.size()))
+			throw cl::Error(CL_INVALID_DEVICE, "DeviceRegistry: invalid device id");
+		return platform.devices[device_id];
+	}
+
+	//cached properties of a device handle (e.g. one taken from a context), nullptr if it was not enumerated
+	const DeviceInfo* Find(const cl::Device& device) const {
+		for (unsigned int i = 0; i < platforms.size(); i++)
+			for (unsigned int j = 0; j < platforms[i].devices.size(); j++)
+				if (platforms[i].devices[j].device() == device())
+					return &platforms[i].devices[j];
+		return nullptr;
+	}
+
+private:
+	DeviceRegistry() {
+		auto start = chrono::steady_clock::now();
+		vector<cl::Platform> cl_platforms;
+		cl::Platform::get(&cl_platforms);
+		GetStartupProfile().Record("platform enumeration", ElapsedMs(start));
+
+		start = chrono::steady_clock::now();
+		vector<future<PlatformInfo>> queries;
+		for (unsigned int i = 0; i < cl_platforms.size(); i++)
+			queries.push_back(async(launch::async, QueryPlatform, cl_platforms[i], (int)i));
+		for (unsigned int i = 0; i < queries.size(); i++)
+			platforms.push_back(queries[i].get());
+		GetStartupProfile().Record("device queries", ElapsedMs(start));
+	}
+
+	static PlatformInfo QueryPlatform(cl::Platform platform, int platform_id) {
+		PlatformInfo info;
+		info.platform = platform;
+		info.name = platform.getInfo<CL_PLATFORM_NAME>();
+		info.vendor = platform.getInfo<CL_PLATFORM_VENDOR>();
+		info.version = platform.getInfo<CL_PLATFORM_VERSION>();
+
+		vector<cl::Device> devices;
+		platform.getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+
+		for (unsigned int j = 0; j < devices.size(); j++) {
+			DeviceInfo device;
+			device.device = devices[j];
+			device.platform_id = platform_id;
+			device.name = devices[j].getInfo<CL_DEVICE_NAME>();
+			device.vendor = devices[j].getInfo<CL_DEVICE_VENDOR>();
+			device.version = devices[j].getInfo<CL_DEVICE_VERSION>();
+			device.driver_version = devices[j].getInfo<CL_DRIVER_VERSION>();
+			device.opencl_c_version = devices[j].getInfo<CL_DEVICE_OPENCL_C_VERSION>();
+			device.extensions = devices[j].getInfo<CL_DEVICE_EXTENSIONS>();
+			device.type = devices[j].getInfo<CL_DEVICE_TYPE>();
+			device.compute_units = devices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+			device.clock_frequency = devices[j].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
+			device.mem_base_addr_align = devices[j].getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>();
+			device.local_mem_size = devices[j].getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+			device.global_mem_size = devices[j].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+			device.max_mem_alloc_size = devices[j].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+			device.max_work_group_size = devices[j].getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>();
+			device.host_unified_memory = devices[j].getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>() == CL_TRUE;
+			device.version_number = ParseVersion(device.version);
+#ifdef ENABLE_SVM
+			//the query is invalid on 1.x devices
+			if (device.version_number >= 200)
+				device.svm_capabilities = devices[j].getInfo<CL_DEVICE_SVM_CAPABILITIES>();
+#endif
+			info.devices.push_back(device);
+		}
+
+		return info;
+	}
+
+	//"OpenCL <major>.<minor> <vendor info>" to major * 100 + minor * 10
+	static int ParseVersion(const string& version) {
+		int major = 0, minor = 0;
+		if (sscanf(version.c_str(), "OpenCL %d.%d", &major, &minor) != 2)
+			return 0;
+		return major * 100 + minor * 10;
+	}
+
+	vector<PlatformInfo> platforms;
+};
+
 string GetPlatformName(int platform_id) {
-	vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	return platforms[platform_id].getInfo<CL_PLATFORM_NAME>();
+	return DeviceRegistry::Get().Platform(platform_id).name;
 }
 
 string GetDeviceName(int platform_id, int device_id) {
-	vector<cl::Platform> platforms;
-	cl::Platform::get(&platforms);
-	vector<cl::Device> devices;
-	platforms[platform_id].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
-	return devices[device_id].getInfo<CL_DEVICE_NAME>();
+	return DeviceRegistry::Get().Device(platform_id, device_id).name;
 }
 
 const char *getErrorString(cl_int error) {
@@ -122,40 +303,36 @@ void CheckError(cl_int error) {
 }
 
 void AddSources(cl::Program::Sources& sources, const string& file_name) {
-	//TODO: add file existence check
 	ifstream file(file_name);
-	string* source_code = new string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>()));
-	sources.push_back((*source_code).c_str());
+	if (!file)
+		throw cl::Error(CL_INVALID_VALUE, "AddSources: cannot open kernel file");
+	//Sources holds its own copy of each string, so the file contents can go out of scope here
+	sources.push_back(string(istreambuf_iterator<char>(file), (istreambuf_iterator<char>())));
 }
 
 string ListPlatformsDevices() {
 
 	stringstream sstream;
-	vector<cl::Platform> platforms;
-
-	cl::Platform::get(&platforms);
+	const vector<PlatformInfo>& platforms = DeviceRegistry::Get().Platforms();
 
 	sstream << "Found " << platforms.size() << " platform(s):" << endl;
 
 	for (unsigned int i = 0; i < platforms.size(); i++)
 	{
-		sstream << "\nPlatform " << i << ", " << platforms[i].getInfo<CL_PLATFORM_NAME>() << ", version: " << platforms[i].getInfo<CL_PLATFORM_VERSION>();
+		sstream << "\nPlatform " << i << ", " << platforms[i].name << ", version: " << platforms[i].version;
 
-		sstream << ", vendor: " << platforms[i].getInfo<CL_PLATFORM_VENDOR>() << endl;
-		//		sstream << ", extensions: " << platforms[i].getInfo<CL_PLATFORM_EXTENSIONS>() << endl;
+		sstream << ", vendor: " << platforms[i].vendor << endl;
 
-		vector<cl::Device> devices;
-
-		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
+		const vector<DeviceInfo>& devices = platforms[i].devices;
 
 		sstream << "\n   Found " << devices.size() << " device(s):" << endl;
 
 		for (unsigned int j = 0; j < devices.size(); j++)
 		{
-			sstream << "\n      Device " << j << ", " << devices[j].getInfo<CL_DEVICE_NAME>() << ", version: " << devices[j].getInfo<CL_DEVICE_VERSION>();
+			sstream << "\n      Device " << j << ", " << devices[j].name << ", version: " << devices[j].version;
 
-			sstream << ", vendor: " << devices[j].getInfo<CL_DEVICE_VENDOR>();
-			cl_device_type device_type = devices[j].getInfo<CL_DEVICE_TYPE>();
+			sstream << ", vendor: " << devices[j].vendor;
+			cl_device_type device_type = devices[j].type;
 			sstream << ", type: ";
 			if (device_type & CL_DEVICE_TYPE_DEFAULT)
 				sstream << "DEFAULT ";
@@ -165,10 +342,11 @@ string ListPlatformsDevices() {
 				sstream << "GPU ";
 			if (device_type & CL_DEVICE_TYPE_ACCELERATOR)
 				sstream << "ACCELERATOR ";
-			sstream << ", compute units: " << devices[j].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
-			sstream << ", clock freq [MHz]: " << devices[j].getInfo<CL_DEVICE_MAX_CLOCK_FREQUENCY>();
-			sstream << ", max memory size [B]: " << devices[j].getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
-			sstream << ", max allocatable memory [B]: " << devices[j].getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+			sstream << ", compute units: " << devices[j].compute_units;
+			sstream << ", clock freq [MHz]: " << devices[j].clock_frequency;
+			sstream << ", max memory size [B]: " << devices[j].global_mem_size;
+			sstream << ", max allocatable memory [B]: " << devices[j].max_mem_alloc_size;
+			sstream << ", local memory size [B]: " << devices[j].local_mem_size;
 
 			sstream << endl;
 		}
@@ -179,25 +357,36 @@ string ListPlatformsDevices() {
 }
 
 cl::Context GetContext(int platform_id, int device_id) {
-	vector<cl::Platform> platforms;
-
-	cl::Platform::get(&platforms);
-
-	for (unsigned int i = 0; i < platforms.size(); i++)
-	{
-		vector<cl::Device> devices;
-		platforms[i].getDevices((cl_device_type)CL_DEVICE_TYPE_ALL, &devices);
-
-		for (unsigned int j = 0; j < devices.size(); j++)
-		{
-			if ((i == platform_id) && (j == device_id))
-				return cl::Context({ devices[j] });
-		}
+	const vector<PlatformInfo>& platforms = DeviceRegistry::Get().Platforms();
+
+	if ((platform_id >= 0) && (platform_id < (int)platforms.size()) &&
+		(device_id >= 0) && (device_id < (int)platforms[platform_id].devices.size())) {
+		auto start = chrono::steady_clock::now();
+		cl::Context context({ platforms[platform_id].devices[device_id].device });
+		GetStartupProfile().Record("context creation", ElapsedMs(start));
+		return context;
 	}
 
 	return cl::Context();
 }
 
+//the sub-device of a CPU device that covers one NUMA node (partitioned by CL_DEVICE_AFFINITY_DOMAIN_NUMA)
+//runtimes return the sub-devices in node order; false when the device cannot be partitioned this way
+bool GetNumaSubDevice(const cl::Device& device, int numa_node, cl::Device& sub_device) {
+	if (numa_node < 0 || !(device.getInfo<CL_DEVICE_PARTITION_AFFINITY_DOMAIN>() & CL_DEVICE_AFFINITY_DOMAIN_NUMA))
+		return false;
+
+	const cl_device_partition_property properties[] = { CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0 };
+	cl::Device parent = device;
+	vector<cl::Device> sub_devices;
+	parent.createSubDevices(properties, &sub_devices);
+	if (numa_node >= (int)sub_devices.size())
+		return false;
+
+	sub_device = sub_devices[numa_node];
+	return true;
+}
+
 enum ProfilingResolution {
 	PROF_NS = 1,
 	PROF_US = 1000,